@@ -0,0 +1,87 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sys/time.h>
+
+using namespace benchmark;
+
+std::map<std::string, BenchFunction>& BenchRunner::benchmarks() {
+    static std::map<std::string, BenchFunction> benchmarks_map;
+    return benchmarks_map;
+}
+
+static double gettimedouble(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_usec * 0.000001 + tv.tv_sec;
+}
+
+BenchRunner::BenchRunner(const std::string& name, BenchFunction func)
+{
+    benchmarks().insert(std::make_pair(name, func));
+}
+
+void
+BenchRunner::RunAll(const std::string& filter, double elapsedTimeForOne)
+{
+    // Times are seconds per iteration
+    std::cout << "#Benchmark" << "," << "samples" << "," << "iterations" << ","
+              << "min" << "," << "median" << "," << "max" << "\n";
+
+    for (BenchmarkMap::iterator it = benchmarks().begin(); it != benchmarks().end(); ++it) {
+        if (!filter.empty() && it->first.find(filter) == std::string::npos)
+            continue;
+        State state(it->first, elapsedTimeForOne);
+        BenchFunction& func = it->second;
+        func(state);
+    }
+}
+
+bool State::KeepRunning()
+{
+    if (count & countMask) {
+      ++count;
+      return true;
+    }
+    double now;
+    if (count == 0) {
+        lastTime = beginTime = now = gettimedouble();
+    }
+    else {
+        now = gettimedouble();
+        double elapsed = now - lastTime;
+        samples.push_back(elapsed * countMaskInv);
+        // Grow the batch while it is too short for the clock to time well.
+        if (elapsed*128 < maxElapsed) {
+            countMask = ((countMask<<1)|1) & ((1LL<<60)-1);
+            countMaskInv = 1./(countMask+1);
+        }
+    }
+    lastTime = now;
+    ++count;
+
+    if (now - beginTime < maxElapsed) return true; // Keep going
+
+    --count;
+
+    std::sort(samples.begin(), samples.end());
+    double minTime = samples.empty() ? 0 : samples.front();
+    double maxTime = samples.empty() ? 0 : samples.back();
+    double medianTime = 0;
+    if (!samples.empty()) {
+        size_t mid = samples.size() / 2;
+        medianTime = samples.size() % 2 ? samples[mid] : (samples[mid - 1] + samples[mid]) / 2;
+    }
+
+    std::cout.precision(6);
+    std::cout << std::scientific
+              << name << "," << samples.size() << "," << count << ","
+              << minTime << "," << medianTime << "," << maxTime << "\n";
+
+    return false;
+}
@@ -0,0 +1,81 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+// Simple micro-benchmarking framework; API mostly matches a subset of the Google Benchmark
+// framework (see https://github.com/google/benchmark)
+// Why not use the Google Benchmark framework? Because adding Yet Another Dependency
+// (that uses cmake as its build system and has lots of features we don't need) isn't
+// worth it.
+
+/*
+ * Usage:
+
+static void CODE_TO_TIME(benchmark::State& state)
+{
+    ... do any setup needed...
+    while (state.KeepRunning()) {
+       ... do stuff you want to time...
+    }
+    ... do any cleanup needed...
+}
+
+BENCHMARK(CODE_TO_TIME);
+
+ */
+
+namespace benchmark {
+
+    /**
+     * Tracks one benchmark run. KeepRunning() is called once per iteration;
+     * it reads the clock only once per batch of iterations, doubling the
+     * batch size while a batch takes less than 1/128th of the time budget.
+     * Each batch yields one per-iteration sample, from which the minimum,
+     * median and maximum are reported.
+     */
+    class State {
+        std::string name;
+        double maxElapsed;
+        double beginTime;
+        double lastTime;
+        uint64_t count;
+        uint64_t countMask;
+        double countMaskInv;
+        std::vector<double> samples;
+    public:
+        State(const std::string& _name, double _maxElapsed) : name(_name), maxElapsed(_maxElapsed), beginTime(0), lastTime(0), count(0), countMask(0), countMaskInv(1.0) {}
+        bool KeepRunning();
+    };
+
+    typedef boost::function<void(State&)> BenchFunction;
+
+    class BenchRunner
+    {
+        typedef std::map<std::string, BenchFunction> BenchmarkMap;
+        static BenchmarkMap &benchmarks();
+
+    public:
+        BenchRunner(const std::string& name, BenchFunction func);
+
+        /** Run every benchmark whose name contains filter, each for about elapsedTimeForOne seconds. */
+        static void RunAll(const std::string& filter = "", double elapsedTimeForOne = 1.0);
+    };
+}
+
+// BENCHMARK(foo) expands to:  benchmark::BenchRunner bench_11foo("foo", foo);
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BITCOIN_BENCH_BENCH_H
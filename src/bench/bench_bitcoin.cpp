@@ -0,0 +1,30 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "crypto/sha256.h"
+#include "key.h"
+#include "pubkey.h"
+#include "script/sigcache.h"
+#include "util.h"
+
+int
+main(int argc, char** argv)
+{
+    SetupEnvironment();
+    ParseParameters(argc, argv);
+    fPrintToDebugLog = false; // don't want to write to debug.log file
+    SHA256AutoDetect();
+    ECC_Start();
+    ECCVerifyHandle verifyHandle;
+    SelectParams(CBaseChainParams::MAIN);
+    InitSignatureCache();
+
+    // -filter=<substring> runs only matching benchmarks; -time=<ms> is the budget per benchmark
+    benchmark::BenchRunner::RunAll(GetArg("-filter", ""), GetArg("-time", 1000) / 1000.0);
+
+    ECC_Stop();
+}
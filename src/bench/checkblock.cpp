@@ -0,0 +1,108 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "consensus/validation.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "version.h"
+
+#include <assert.h>
+
+/**
+ * Build a block shaped like a full mainnet block: about 2000 transactions,
+ * each spending two pay-to-pubkey-hash outputs and creating two. Contents are
+ * derived from a counter so every run measures the same bytes.
+ */
+static CBlock MakeMainnetLikeBlock()
+{
+    CBlock block;
+    block.nVersion = 3;
+    block.nTime = 1438000000;
+    block.nBits = 0x1d00ffff;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 400000 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 25 * COIN;
+    coinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(coinbase);
+
+    uint32_t nCounter = 0;
+    while (block.vtx.size() < 2000) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        tx.vout.resize(2);
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            CHashWriter ss(SER_GETHASH, 0);
+            ss << nCounter++;
+            tx.vin[i].prevout = COutPoint(ss.GetHash(), i);
+            // DER signature plus compressed public key
+            std::vector<unsigned char> vchSig(72, (unsigned char)nCounter);
+            std::vector<unsigned char> vchPubKey(33, (unsigned char)(nCounter >> 8));
+            vchPubKey[0] = 0x02;
+            tx.vin[i].scriptSig = CScript() << vchSig << vchPubKey;
+        }
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            tx.vout[i].nValue = 1000000 + nCounter;
+            tx.vout[i].scriptPubKey = GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, (unsigned char)(nCounter + i)))));
+        }
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void DeserializeBlockTest(benchmark::State& state)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << MakeMainnetLikeBlock();
+    const std::vector<char> vchRaw(stream.begin(), stream.end());
+
+    while (state.KeepRunning()) {
+        CDataStream ss(vchRaw, SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        ss >> block;
+        assert(ss.empty());
+    }
+}
+
+static void SerializeBlockTest(benchmark::State& state)
+{
+    const CBlock block = MakeMainnetLikeBlock();
+
+    while (state.KeepRunning()) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+    }
+}
+
+// Deserialize and run the context-free checks, as done for every block
+// received from the network. CheckBlock recomputes the merkle root from
+// freshly computed transaction hashes.
+static void DeserializeAndCheckBlockTest(benchmark::State& state)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << MakeMainnetLikeBlock();
+    const std::vector<char> vchRaw(stream.begin(), stream.end());
+
+    while (state.KeepRunning()) {
+        CDataStream ss(vchRaw, SER_NETWORK, PROTOCOL_VERSION);
+        CBlock block;
+        ss >> block;
+        CValidationState validationState;
+        bool fChecked = CheckBlock(block, validationState, false, true);
+        assert(fChecked);
+    }
+}
+
+BENCHMARK(DeserializeBlockTest);
+BENCHMARK(SerializeBlockTest);
+BENCHMARK(DeserializeAndCheckBlockTest);
@@ -0,0 +1,51 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "random.h"
+#include "wallet/wallet.h"
+
+#include <assert.h>
+#include <set>
+#include <utility>
+#include <vector>
+
+/* Number of spendable outputs in the wallet, as on a busy payout wallet */
+static const unsigned int NUM_COINS = 100000;
+
+static std::vector<COutput> MakeCoins(CWallet& wallet, unsigned int n)
+{
+    std::vector<COutput> vCoins;
+    vCoins.reserve(n);
+    for (unsigned int i = 0; i < n; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i; // so all transactions get different hashes
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000 + GetRand(10 * CENT);
+        vCoins.push_back(COutput(new CWalletTx(&wallet, tx), 0, 6 * 24, true));
+    }
+    return vCoins;
+}
+
+// Select inputs for a payment from a wallet with many small outputs, where
+// an exact match is unlikely.
+static void CoinSelection(benchmark::State& state)
+{
+    CWallet wallet;
+    std::vector<COutput> vCoins = MakeCoins(wallet, NUM_COINS);
+    std::set<std::pair<const CWalletTx*, unsigned int> > setCoinsRet;
+    CAmount nValueRet;
+
+    while (state.KeepRunning()) {
+        bool fSuccess = wallet.SelectCoinsMinConf(10 * COIN + GetRand(COIN), 1, 6, vCoins, setCoinsRet, nValueRet);
+        assert(fSuccess);
+    }
+
+    for (unsigned int i = 0; i < vCoins.size(); i++)
+        delete vCoins[i].tx;
+}
+
+BENCHMARK(CoinSelection);
@@ -0,0 +1,79 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coins.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
+#include "uint256.h"
+
+#include <assert.h>
+#include <vector>
+
+/* Number of coins touched per iteration */
+static const unsigned int NUM_COINS = 1000;
+
+static Coin MakeCoin()
+{
+    CTxOut out(50000, GetScriptForDestination(CKeyID(uint160(std::vector<unsigned char>(20, 1)))));
+    return Coin(out, 100000, false);
+}
+
+static std::vector<COutPoint> MakeOutpoints(unsigned int n)
+{
+    std::vector<COutPoint> vOutpoints;
+    vOutpoints.reserve(n);
+    for (unsigned int i = 0; i < n; i++)
+        vOutpoints.push_back(COutPoint(GetRandHash(), i % 4));
+    return vOutpoints;
+}
+
+// Look up coins that live in the parent cache through a fresh child cache,
+// as block validation does for every input.
+static void CCoinsCachingFetch(benchmark::State& state)
+{
+    CCoinsView viewDummy;
+    CCoinsViewCache base(&viewDummy);
+    std::vector<COutPoint> vOutpoints = MakeOutpoints(NUM_COINS);
+    Coin coin = MakeCoin();
+    for (unsigned int i = 0; i < vOutpoints.size(); i++)
+        base.AddCoin(vOutpoints[i], coin, false);
+
+    while (state.KeepRunning()) {
+        CCoinsViewCache cache(&base);
+        for (unsigned int i = 0; i < vOutpoints.size(); i++)
+            cache.AccessCoin(vOutpoints[i]);
+    }
+}
+
+// Create coins in a child cache and flush them to the parent, then spend
+// them in another child and flush again, so the parent stays the same size.
+static void CCoinsCachingFlush(benchmark::State& state)
+{
+    CCoinsView viewDummy;
+    CCoinsViewCache base(&viewDummy);
+    std::vector<COutPoint> vOutpoints = MakeOutpoints(NUM_COINS);
+    Coin coin = MakeCoin();
+
+    while (state.KeepRunning()) {
+        {
+            CCoinsViewCache cache(&base);
+            for (unsigned int i = 0; i < vOutpoints.size(); i++)
+                cache.AddCoin(vOutpoints[i], coin, false);
+            cache.Flush();
+        }
+        {
+            CCoinsViewCache cache(&base);
+            for (unsigned int i = 0; i < vOutpoints.size(); i++)
+                cache.SpendCoin(vOutpoints[i]);
+            cache.Flush();
+        }
+    }
+    assert(base.GetCacheSize() == 0);
+}
+
+BENCHMARK(CCoinsCachingFetch);
+BENCHMARK(CCoinsCachingFlush);
@@ -0,0 +1,53 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "hash.h"
+#include "uint256.h"
+#include "crypto/sha256.h"
+
+#include <vector>
+
+/* Number of bytes to hash per iteration */
+static const uint64_t BUFFER_SIZE = 1000*1000;
+
+static void SHA256(benchmark::State& state)
+{
+    uint8_t hash[CSHA256::OUTPUT_SIZE];
+    std::vector<uint8_t> in(BUFFER_SIZE,0);
+    while (state.KeepRunning())
+        CSHA256().Write(begin_ptr(in), in.size()).Finalize(hash);
+}
+
+// Double-SHA256 of 64 bytes, the shape of a merkle tree node
+static void SHA256D64_1(benchmark::State& state)
+{
+    uint256 left, right;
+    while (state.KeepRunning())
+        left = Hash(left.begin(), left.end(), right.begin(), right.end());
+}
+
+// A merkle tree level of 1024 nodes, hashed through the batched interface
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning())
+        SHA256D64(begin_ptr(out), begin_ptr(in), 1024);
+}
+
+// Double-SHA256 of a large buffer, as for transaction and block hashing
+static void SHA256D(benchmark::State& state)
+{
+    uint8_t hash[CHash256::OUTPUT_SIZE];
+    std::vector<uint8_t> in(BUFFER_SIZE,0);
+    while (state.KeepRunning())
+        CHash256().Write(begin_ptr(in), in.size()).Finalize(hash);
+}
+
+BENCHMARK(SHA256);
+BENCHMARK(SHA256D64_1);
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(SHA256D);
@@ -0,0 +1,67 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "main.h"
+#include "random.h"
+#include "txmempool.h"
+#include "utiltime.h"
+
+#include <assert.h>
+#include <string>
+#include <vector>
+
+/* Number of unrelated chains and transactions per chain added per iteration */
+static const unsigned int NUM_CHAINS = 100;
+static const unsigned int CHAIN_LENGTH = 10;
+
+static std::vector<CTransaction> MakeChains()
+{
+    std::vector<CTransaction> vtx;
+    for (unsigned int c = 0; c < NUM_CHAINS; c++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[1].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+        tx.vout[0].nValue = tx.vout[1].nValue = 10 * COIN;
+        for (unsigned int i = 0; i < CHAIN_LENGTH; i++) {
+            vtx.push_back(tx);
+            tx.vin[0].prevout = COutPoint(vtx.back().GetHash(), 0);
+            tx.vout[0].nValue -= 1000;
+        }
+    }
+    return vtx;
+}
+
+// Insert chained transactions the way AcceptToMemoryPool does once inputs
+// are verified: compute in-mempool ancestors under the default package
+// limits, then add the entry and update its ancestors and descendants.
+// Finally trim the pool to half its size, which evicts whole packages.
+static void MempoolAccept(benchmark::State& state)
+{
+    const std::vector<CTransaction> vtx = MakeChains();
+    int64_t nTime = GetTime();
+
+    while (state.KeepRunning()) {
+        CTxMemPool pool(CFeeRate(1000));
+        LOCK(pool.cs);
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            CTxMemPoolEntry entry(vtx[i], 1000 + (i % 7) * 500, nTime, 0.0, 1, pool.HasNoInputsOf(vtx[i]), 1);
+            CTxMemPool::setEntries setAncestors;
+            std::string errString;
+            bool fOk = pool.CalculateMemPoolAncestors(entry, setAncestors, DEFAULT_ANCESTOR_LIMIT, DEFAULT_ANCESTOR_SIZE_LIMIT * 1000,
+                                                      DEFAULT_DESCENDANT_LIMIT, DEFAULT_DESCENDANT_SIZE_LIMIT * 1000, errString);
+            assert(fOk);
+            pool.addUnchecked(vtx[i].GetHash(), entry, setAncestors, false);
+        }
+        pool.TrimToSize(pool.DynamicMemoryUsage() / 2);
+    }
+}
+
+BENCHMARK(MempoolAccept);
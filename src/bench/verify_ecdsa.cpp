@@ -0,0 +1,43 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <assert.h>
+#include <vector>
+
+static void ECDSAVerify(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    assert(pubkey.Verify(hash, vchSig));
+
+    while (state.KeepRunning()) {
+        pubkey.Verify(hash, vchSig);
+    }
+}
+
+static void ECDSASign(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+
+    while (state.KeepRunning()) {
+        key.Sign(hash, vchSig);
+    }
+}
+
+BENCHMARK(ECDSAVerify);
+BENCHMARK(ECDSASign);
@@ -0,0 +1,115 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockprefetch.h"
+
+#include "coins.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "util.h"
+
+#include <set>
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+CBlockPrefetcher blockPrefetcher;
+
+CBlockPrefetcher::CBlockPrefetcher() : pview(NULL), nConnectedHeight(-1)
+{
+}
+
+void CBlockPrefetcher::SetView(CCoinsView* pviewIn)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    pview = pviewIn;
+    if (!pview)
+        queue.clear();
+}
+
+bool CBlockPrefetcher::IsEnabled()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return pview != NULL;
+}
+
+void CBlockPrefetcher::Add(int nHeight, const CDiskBlockPos& pos)
+{
+    CQueuedBlock entry;
+    entry.nHeight = nHeight;
+    entry.pos = pos;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!pview || nHeight <= nConnectedHeight)
+        return;
+    queue.push_back(entry);
+    cond.notify_one();
+}
+
+void CBlockPrefetcher::Add(int nHeight, const boost::shared_ptr<const CBlock>& pblock)
+{
+    CQueuedBlock entry;
+    entry.nHeight = nHeight;
+    entry.pblock = pblock;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (!pview || nHeight <= nConnectedHeight)
+        return;
+    queue.push_back(entry);
+    cond.notify_one();
+}
+
+void CBlockPrefetcher::SetConnectedHeight(int nHeight)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nConnectedHeight = nHeight;
+}
+
+void CBlockPrefetcher::PrefetchInputs(const CBlock& block, CCoinsView* pviewIn)
+{
+    // Outputs created within the block are not in the database yet.
+    std::set<uint256> setBlockTxids;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        setBlockTxids.insert(tx.GetHash());
+
+    Coin coin;
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        boost::this_thread::interruption_point();
+        BOOST_FOREACH(const CTxIn& txin, block.vtx[i].vin) {
+            if (!setBlockTxids.count(txin.prevout.hash))
+                pviewIn->GetCoin(txin.prevout, coin);
+        }
+    }
+}
+
+void CBlockPrefetcher::Thread()
+{
+    while (true) {
+        CQueuedBlock entry;
+        CCoinsView* pviewIn;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queue.empty())
+                cond.wait(lock);
+            entry = queue.front();
+            queue.pop_front();
+            pviewIn = pview;
+            // The validation thread got there first
+            if (!pviewIn || entry.nHeight <= nConnectedHeight)
+                continue;
+        }
+
+        try {
+            boost::shared_ptr<const CBlock> pblock = entry.pblock;
+            if (!pblock) {
+                boost::shared_ptr<CBlock> pblockRead(new CBlock());
+                if (!ReadBlockFromDisk(*pblockRead, entry.pos))
+                    continue;
+                pblock = pblockRead;
+            }
+            PrefetchInputs(*pblock, pviewIn);
+        } catch (const std::exception& e) {
+            // The validation thread will run into (and report) the same problem.
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+    }
+}
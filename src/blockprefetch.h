@@ -0,0 +1,82 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKPREFETCH_H
+#define BITCOIN_BLOCKPREFETCH_H
+
+#include "chain.h"
+
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CBlock;
+class CCoinsView;
+
+/** -prefetchthreads default */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+/** Maximum number of block input prefetch threads */
+static const int MAX_PREFETCH_THREADS = 16;
+/** How many blocks past the tip to queue for prefetching */
+static const int PREFETCH_BLOCKS_AHEAD = 32;
+
+/**
+ * Looks up the inputs of blocks that are about to be connected, ahead of
+ * the validation thread.
+ *
+ * During initial block download and reindex, ConnectBlock mostly waits on
+ * random chainstate reads, one input at a time. The prefetch threads read
+ * queued blocks and fetch their prevouts from the database view, so the
+ * LevelDB block cache and the OS page cache already hold them when the
+ * validation thread asks. Nothing is inserted into pcoinsTip: it is not
+ * thread-safe, and a coin read ahead of time could be stale by the time the
+ * block is connected. Reading the block also leaves it in the block cache.
+ */
+class CBlockPrefetcher
+{
+private:
+    struct CQueuedBlock {
+        int nHeight;
+        CDiskBlockPos pos;
+        boost::shared_ptr<const CBlock> pblock;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<CQueuedBlock> queue;
+    //! Database view to read from; NULL while prefetching is disabled
+    CCoinsView* pview;
+    //! Queued blocks at or below this height are already connected
+    int nConnectedHeight;
+
+    void PrefetchInputs(const CBlock& block, CCoinsView* pviewIn);
+
+public:
+    CBlockPrefetcher();
+
+    /**
+     * Read coins from view (not owned); NULL disables prefetching and empties
+     * the queue. Threads that are already looking up a block keep using the
+     * old view, so only change it while no prefetch threads are running.
+     */
+    void SetView(CCoinsView* pviewIn);
+    bool IsEnabled();
+
+    /** Queue the block at height nHeight stored at pos. */
+    void Add(int nHeight, const CDiskBlockPos& pos);
+    /** Queue a block that is already in memory. */
+    void Add(int nHeight, const boost::shared_ptr<const CBlock>& pblock);
+
+    /** The active chain has reached nHeight; skip queued blocks up to it. */
+    void SetConnectedHeight(int nHeight);
+
+    /** Worker loop; runs until the thread is interrupted. */
+    void Thread();
+};
+
+extern CBlockPrefetcher blockPrefetcher;
+
+#endif // BITCOIN_BLOCKPREFETCH_H
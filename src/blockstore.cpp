@@ -0,0 +1,215 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+
+#include "clientversion.h"
+#include "consensus/consensus.h"
+#include "crypto/common.h"
+#include "main.h"
+#include "streams.h"
+#include "util.h"
+
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFileStore blockFileStore;
+
+/** A read-only mapping of a whole block file; unmapped when the last reader lets go of it. */
+class CBlockFileStore::CMappedFile
+{
+public:
+    const unsigned char* pbegin;
+    size_t nSize;
+
+    CMappedFile(const unsigned char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+    ~CMappedFile()
+    {
+#ifndef WIN32
+        munmap((void*)pbegin, nSize);
+#endif
+    }
+};
+
+CBlockFileStore::CBlockFileStore() : nMaxCacheBytes(DEFAULT_BLOCK_CACHE_SIZE << 20), nCacheBytes(0)
+{
+}
+
+CBlockFileStore::~CBlockFileStore()
+{
+}
+
+boost::shared_ptr<CBlockFileStore::CMappedFile> CBlockFileStore::GetMappedFile(int nFile, size_t nMinSize)
+{
+    boost::shared_ptr<CMappedFile> pfile;
+#ifndef WIN32
+    if (MAX_MAPPED_BLOCK_FILES == 0)
+        return pfile;
+
+    LOCK(cs);
+    FileMap::iterator it = mapFiles.find(nFile);
+    if (it != mapFiles.end()) {
+        if (it->second.first->nSize >= nMinSize) {
+            lruFiles.splice(lruFiles.begin(), lruFiles, it->second.second);
+            return it->second.first;
+        }
+        // The file grew since it was mapped; readers of the old mapping keep it alive.
+        lruFiles.erase(it->second.second);
+        mapFiles.erase(it);
+    }
+
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return pfile;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (size_t)st.st_size >= nMinSize)
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return pfile;
+
+    pfile.reset(new CMappedFile((const unsigned char*)p, st.st_size));
+    lruFiles.push_front(nFile);
+    mapFiles.insert(std::make_pair(nFile, std::make_pair(pfile, lruFiles.begin())));
+    while (lruFiles.size() > MAX_MAPPED_BLOCK_FILES) {
+        mapFiles.erase(lruFiles.back());
+        lruFiles.pop_back();
+    }
+#endif
+    return pfile;
+}
+
+bool CBlockFileStore::ReadFile(const CDiskBlockPos& pos, unsigned char* pch, unsigned int nSize)
+{
+    boost::shared_ptr<CMappedFile> pfile = GetMappedFile(pos.nFile, (size_t)pos.nPos + nSize);
+    if (pfile) {
+        memcpy(pch, pfile->pbegin + pos.nPos, nSize);
+        return true;
+    }
+
+    // Fall back to reading through stdio
+    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return false;
+    try {
+        filein.read((char*)pch, nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+}
+
+void CBlockFileStore::AddLocked(const BlockKey& key, const BlockBytes& block)
+{
+    if (block->size() > nMaxCacheBytes)
+        return;
+    BlockMap::iterator it = mapBlocks.find(key);
+    if (it != mapBlocks.end()) {
+        lruBlocks.splice(lruBlocks.begin(), lruBlocks, it->second.second);
+        return;
+    }
+    lruBlocks.push_front(key);
+    mapBlocks.insert(std::make_pair(key, std::make_pair(block, lruBlocks.begin())));
+    nCacheBytes += block->size();
+    EvictLocked();
+}
+
+void CBlockFileStore::EvictLocked()
+{
+    while (nCacheBytes > nMaxCacheBytes) {
+        BlockMap::iterator it = mapBlocks.find(lruBlocks.back());
+        nCacheBytes -= it->second.first->size();
+        mapBlocks.erase(it);
+        lruBlocks.pop_back();
+    }
+}
+
+void CBlockFileStore::SetMaxCacheSize(size_t nMaxBytes)
+{
+    LOCK(cs);
+    nMaxCacheBytes = nMaxBytes;
+    EvictLocked();
+}
+
+size_t CBlockFileStore::GetCacheSize() const
+{
+    LOCK(cs);
+    return nCacheBytes;
+}
+
+bool CBlockFileStore::ReadBlock(const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart, BlockBytes& block)
+{
+    BlockKey key(pos.nFile, pos.nPos);
+    {
+        LOCK(cs);
+        BlockMap::iterator it = mapBlocks.find(key);
+        if (it != mapBlocks.end()) {
+            lruBlocks.splice(lruBlocks.begin(), lruBlocks, it->second.second);
+            block = it->second.first;
+            return true;
+        }
+    }
+
+    // Blocks are stored after their message start and size, see WriteBlockToDisk
+    unsigned char header[MESSAGE_START_SIZE + sizeof(uint32_t)];
+    if (pos.IsNull() || pos.nPos < sizeof(header))
+        return error("%s: Invalid block position %s", __func__, pos.ToString());
+    if (!ReadFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(header)), header, sizeof(header)))
+        return error("%s: Unable to read block file at %s", __func__, pos.ToString());
+    if (memcmp(header, messageStart, MESSAGE_START_SIZE))
+        return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+    unsigned int nSize = ReadLE32(header + MESSAGE_START_SIZE);
+    if (nSize > MAX_BLOCK_SIZE)
+        return error("%s: Block size %u too large at %s", __func__, nSize, pos.ToString());
+
+    boost::shared_ptr<std::vector<unsigned char> > pblock(new std::vector<unsigned char>(nSize));
+    if (!ReadFile(pos, begin_ptr(*pblock), nSize))
+        return error("%s: Unable to read block file at %s", __func__, pos.ToString());
+    block = pblock;
+
+    LOCK(cs);
+    AddLocked(key, block);
+    return true;
+}
+
+void CBlockFileStore::AddBlock(const CDiskBlockPos& pos, const BlockBytes& block)
+{
+    LOCK(cs);
+    AddLocked(BlockKey(pos.nFile, pos.nPos), block);
+}
+
+void CBlockFileStore::Invalidate(int nFile)
+{
+    LOCK(cs);
+    BlockMap::iterator it = mapBlocks.lower_bound(BlockKey(nFile, 0));
+    while (it != mapBlocks.end() && it->first.first == nFile) {
+        nCacheBytes -= it->second.first->size();
+        lruBlocks.erase(it->second.second);
+        mapBlocks.erase(it++);
+    }
+    FileMap::iterator itFile = mapFiles.find(nFile);
+    if (itFile != mapFiles.end()) {
+        lruFiles.erase(itFile->second.second);
+        mapFiles.erase(itFile);
+    }
+}
+
+void CBlockFileStore::Clear()
+{
+    LOCK(cs);
+    mapBlocks.clear();
+    lruBlocks.clear();
+    nCacheBytes = 0;
+    mapFiles.clear();
+    lruFiles.clear();
+}
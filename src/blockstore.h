@@ -0,0 +1,92 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKSTORE_H
+#define BITCOIN_BLOCKSTORE_H
+
+#include "chain.h"
+#include "protocol.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+//! -blockcachesize default (MiB)
+static const int64_t DEFAULT_BLOCK_CACHE_SIZE = 32;
+//! max. -blockcachesize (MiB)
+static const int64_t MAX_BLOCK_CACHE_SIZE = sizeof(void*) > 4 ? 4096 : 256;
+//! Number of block files kept memory mapped (none in 32-bit processes, to save address space)
+static const unsigned int MAX_MAPPED_BLOCK_FILES = sizeof(void*) > 4 ? 8 : 0;
+
+/**
+ * Read access to the blocks in blk?????.dat files.
+ *
+ * Recently used block files stay memory mapped, so a read is a copy out of
+ * the page cache rather than an open, seek and read of a FILE. On top of
+ * that, the serialized bytes of recently read or written blocks are kept in
+ * an LRU cache bounded in bytes, so repeated requests for the same blocks
+ * (typically those near the tip) do not touch the files at all.
+ *
+ * Blocks are identified by the position of their first byte, as recorded in
+ * the block index. Block files are only ever appended to, so cached bytes stay
+ * valid until a file is pruned; Invalidate() it before it is removed.
+ */
+class CBlockFileStore
+{
+public:
+    typedef boost::shared_ptr<const std::vector<unsigned char> > BlockBytes;
+
+private:
+    class CMappedFile;
+    typedef std::pair<int, unsigned int> BlockKey;
+    typedef std::list<BlockKey> BlockLRU;
+    typedef std::map<BlockKey, std::pair<BlockBytes, BlockLRU::iterator> > BlockMap;
+    typedef std::map<int, std::pair<boost::shared_ptr<CMappedFile>, std::list<int>::iterator> > FileMap;
+
+    mutable CCriticalSection cs;
+    size_t nMaxCacheBytes;
+    size_t nCacheBytes;
+    //! Cached blocks, most recently used at the front of lruBlocks
+    BlockMap mapBlocks;
+    BlockLRU lruBlocks;
+    //! Mapped files, most recently used at the front of lruFiles
+    FileMap mapFiles;
+    std::list<int> lruFiles;
+
+    boost::shared_ptr<CMappedFile> GetMappedFile(int nFile, size_t nMinSize);
+    bool ReadFile(const CDiskBlockPos& pos, unsigned char* pch, unsigned int nSize);
+    void AddLocked(const BlockKey& key, const BlockBytes& block);
+    void EvictLocked();
+
+public:
+    CBlockFileStore();
+    ~CBlockFileStore();
+
+    /** Limit the block cache to nMaxBytes, evicting blocks if needed. */
+    void SetMaxCacheSize(size_t nMaxBytes);
+    size_t GetCacheSize() const;
+
+    /**
+     * Get the serialized block stored at pos. The message start and size that
+     * precede it in the file are checked; the block itself is not.
+     */
+    bool ReadBlock(const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart, BlockBytes& block);
+
+    /** Remember the serialized block just written at pos. */
+    void AddBlock(const CDiskBlockPos& pos, const BlockBytes& block);
+
+    /** Forget everything about block file nFile. */
+    void Invalidate(int nFile);
+
+    /** Forget everything, e.g. when the block files are about to change underneath. */
+    void Clear();
+};
+
+extern CBlockFileStore blockFileStore;
+
+#endif // BITCOIN_BLOCKSTORE_H
@@ -107,3 +107,22 @@ void CBlockIndex::BuildSkip()
     if (pprev)
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
+
+CBlockIndex* CBlockIndexArena::Allocate(const CBlockIndex& index)
+{
+    if (nUsed == SLAB_SIZE) {
+        vSlabs.push_back(new CBlockIndex[SLAB_SIZE]);
+        nUsed = 0;
+    }
+    CBlockIndex* pindex = &vSlabs.back()[nUsed++];
+    *pindex = index;
+    return pindex;
+}
+
+void CBlockIndexArena::Clear()
+{
+    BOOST_FOREACH(CBlockIndex* pslab, vSlabs)
+        delete[] pslab;
+    vSlabs.clear();
+    nUsed = SLAB_SIZE;
+}
@@ -346,6 +346,37 @@ public:
     }
 };
 
+/**
+ * Allocator for CBlockIndex entries, which keeps them densely packed in large
+ * slabs instead of allocating each one separately. Entries are never freed one
+ * by one, as the block index only grows; Clear() releases them all at once.
+ * Allocated entries keep their address until then.
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vSlabs;
+    //! Number of entries handed out from the last slab
+    size_t nUsed;
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    void operator=(const CBlockIndexArena&);
+
+public:
+    //! Number of entries per slab
+    static const size_t SLAB_SIZE = 4096;
+
+    CBlockIndexArena() : nUsed(SLAB_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    //! Return a new entry, initialized as a copy of index
+    CBlockIndex* Allocate(const CBlockIndex& index = CBlockIndex());
+    //! Number of entries allocated
+    size_t size() const { return vSlabs.empty() ? 0 : (vSlabs.size() - 1) * SLAB_SIZE + nUsed; }
+    //! Free all entries
+    void Clear();
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
@@ -0,0 +1,150 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsflush.h"
+
+#include "util.h"
+
+#include <boost/bind.hpp>
+
+CCoinsViewFlusher::CCoinsViewFlusher(CCoinsView* viewIn) :
+    CCoinsViewBacked(viewIn), fInFlight(false), nInFlightUsage(0), fFailed(false), fStop(false),
+    writer(boost::bind(&CCoinsViewFlusher::Thread, this))
+{
+}
+
+CCoinsViewFlusher::~CCoinsViewFlusher()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condWork.notify_one();
+    }
+    writer.join();
+}
+
+void CCoinsViewFlusher::WaitIdle(boost::unique_lock<boost::mutex>& lock) const
+{
+    while (fInFlight)
+        condDone.wait(lock);
+}
+
+bool CCoinsViewFlusher::GetCoin(const COutPoint &outpoint, Coin &coin) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fInFlight) {
+            CCoinsMap::const_iterator it = mapInFlight.find(outpoint);
+            if (it != mapInFlight.end()) {
+                coin = it->second.coin;
+                return !coin.IsSpent();
+            }
+        }
+    }
+    // Outpoints outside the snapshot are not touched by the write in flight.
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewFlusher::HaveCoin(const COutPoint &outpoint) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fInFlight) {
+            CCoinsMap::const_iterator it = mapInFlight.find(outpoint);
+            if (it != mapInFlight.end())
+                return !it->second.coin.IsSpent();
+        }
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewFlusher::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fInFlight && !hashInFlight.IsNull())
+            return hashInFlight;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewFlusher::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    size_t nUsage = memusage::DynamicUsage(mapCoins);
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+        nUsage += it->second.coin.DynamicMemoryUsage();
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitIdle(lock);
+    if (fFailed)
+        return false;
+    if (mapCoins.empty() && hashBlock.IsNull())
+        return true;
+    mapInFlight.swap(mapCoins);
+    hashInFlight = hashBlock;
+    nInFlightUsage = nUsage;
+    fInFlight = true;
+    condWork.notify_one();
+    return true;
+}
+
+bool CCoinsViewFlusher::GetStats(CCoinsStats &stats) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        WaitIdle(lock);
+    }
+    return base->GetStats(stats);
+}
+
+size_t CCoinsViewFlusher::DynamicMemoryUsage() const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return nInFlightUsage;
+}
+
+bool CCoinsViewFlusher::Sync()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitIdle(lock);
+    return !fFailed;
+}
+
+void CCoinsViewFlusher::Thread()
+{
+    RenameThread("bitcoin-coinsflush");
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fInFlight && !fStop)
+                condWork.wait(lock);
+            // Finish the last write before stopping
+            if (!fInFlight)
+                return;
+        }
+
+        // The snapshot only changes while no write is in flight, so it can
+        // be read here without the lock, concurrently with lookups.
+        bool fOk = false;
+        try {
+            fOk = base->BatchWrite(mapInFlight, hashInFlight);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        if (!fOk)
+            LogPrintf("%s: Failed to write to coin database\n", __func__);
+
+        CCoinsMap mapDone;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapDone.swap(mapInFlight);
+            hashInFlight.SetNull();
+            nInFlightUsage = 0;
+            fInFlight = false;
+            fFailed |= !fOk;
+            condDone.notify_all();
+        }
+        // mapDone is freed here, without holding up lookups.
+    }
+}
@@ -0,0 +1,72 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSFLUSH_H
+#define BITCOIN_COINSFLUSH_H
+
+#include "coins.h"
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/**
+ * CCoinsView that writes the changes passed to BatchWrite to its base on a
+ * background thread.
+ *
+ * BatchWrite takes over the flushed entries as a snapshot and returns right
+ * away, so the cache above it can keep connecting blocks while the database
+ * commits. Until the write completes, lookups are answered from the snapshot
+ * first. Only one snapshot is in flight at a time: the next BatchWrite waits
+ * for the previous one, which keeps the writes in order. While a write is
+ * in flight the snapshot is held in addition to the cache above; its size is
+ * reported by DynamicMemoryUsage, so that it can be counted against the
+ * cache limit.
+ *
+ * The base view must leave the map passed to its BatchWrite unmodified, as
+ * the snapshot is read concurrently while it is being written (CCoinsViewDB
+ * does). A failed write is reported by the next BatchWrite or Sync.
+ */
+class CCoinsViewFlusher : public CCoinsViewBacked
+{
+private:
+    mutable boost::mutex mutex;
+    boost::condition_variable condWork;
+    mutable boost::condition_variable condDone;
+
+    //! Entries being written to the base view, and the best block they belong to
+    CCoinsMap mapInFlight;
+    uint256 hashInFlight;
+    //! Whether mapInFlight is being written
+    bool fInFlight;
+    //! Memory used by mapInFlight
+    size_t nInFlightUsage;
+    //! Whether a write to the base view has failed
+    bool fFailed;
+    bool fStop;
+
+    boost::thread writer;
+
+    void WaitIdle(boost::unique_lock<boost::mutex>& lock) const;
+    void Thread();
+
+public:
+    CCoinsViewFlusher(CCoinsView* viewIn);
+    /** Completes the write in flight, if any. */
+    ~CCoinsViewFlusher();
+
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    bool GetStats(CCoinsStats &stats) const;
+
+    /** Wait until the base view holds everything written so far; false if a write failed. */
+    bool Sync();
+
+    //! Memory used by the entries being written (in bytes)
+    size_t DynamicMemoryUsage() const;
+};
+
+#endif // BITCOIN_COINSFLUSH_H
@@ -0,0 +1,175 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+namespace {
+
+typedef Num3072::limb_t limb_t;
+typedef Num3072::double_limb_t double_limb_t;
+
+/** 2^3072 minus the modulus; 2^3072 is congruent to this. */
+const limb_t MAX_PRIME_DIFF = 1103717;
+
+/** Whether a, which is below 2^3072, is at least the modulus. */
+bool IsOverflow(const Num3072& a)
+{
+    if (a.limbs[0] < (limb_t)0 - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < Num3072::LIMBS; ++i) {
+        if (a.limbs[i] != (limb_t)-1)
+            return false;
+    }
+    return true;
+}
+
+/** Subtract the modulus from a, which is below 2^3072 but at least the modulus. */
+void FullReduce(Num3072& a)
+{
+    // a - p = a + MAX_PRIME_DIFF - 2^3072: add and drop the carry out of the top limb.
+    double_limb_t t = MAX_PRIME_DIFF;
+    for (int i = 0; i < Num3072::LIMBS; ++i) {
+        t += a.limbs[i];
+        a.limbs[i] = (limb_t)t;
+        t >>= Num3072::LIMB_SIZE;
+    }
+}
+
+} // namespace
+
+Num3072::Num3072(const unsigned char* data)
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        limbs[i] = 0;
+        for (int j = LIMB_SIZE / 8 - 1; j >= 0; --j)
+            limbs[i] = (limbs[i] << 8) | data[i * (LIMB_SIZE / 8) + j];
+    }
+    if (IsOverflow(*this))
+        FullReduce(*this);
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i)
+        limbs[i] = 0;
+}
+
+void Num3072::ToBytes(unsigned char* out) const
+{
+    for (int i = 0; i < LIMBS; ++i) {
+        for (int j = 0; j < LIMB_SIZE / 8; ++j)
+            out[i * (LIMB_SIZE / 8) + j] = (unsigned char)(limbs[i] >> (8 * j));
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook product into 2 * LIMBS limbs; a may be *this.
+    limb_t tmp[2 * LIMBS];
+    memset(tmp, 0, sizeof(tmp));
+    for (int i = 0; i < LIMBS; ++i) {
+        limb_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            double_limb_t t = (double_limb_t)limbs[i] * a.limbs[j] + tmp[i + j] + carry;
+            tmp[i + j] = (limb_t)t;
+            carry = (limb_t)(t >> LIMB_SIZE);
+        }
+        tmp[i + LIMBS] = carry;
+    }
+
+    // Fold the high half back in, as 2^3072 is congruent to MAX_PRIME_DIFF.
+    limb_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        double_limb_t t = (double_limb_t)tmp[LIMBS + i] * MAX_PRIME_DIFF + tmp[i] + carry;
+        limbs[i] = (limb_t)t;
+        carry = (limb_t)(t >> LIMB_SIZE);
+    }
+    // The same for what is left above 2^3072; this ends after at most two rounds.
+    while (carry) {
+        double_limb_t t = (double_limb_t)carry * MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && t; ++i) {
+            t += limbs[i];
+            limbs[i] = (limb_t)t;
+            t >>= LIMB_SIZE;
+        }
+        carry = (limb_t)t;
+    }
+    if (IsOverflow(*this))
+        FullReduce(*this);
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // Fermat: a^(p-2) is the inverse of a modulo the prime p. All limbs of
+    // p - 2 are all ones, except the lowest.
+    Num3072 result;
+    for (int i = LIMBS - 1; i >= 0; --i) {
+        const limb_t e = i ? (limb_t)-1 : (limb_t)0 - MAX_PRIME_DIFF - 2;
+        for (int j = LIMB_SIZE - 1; j >= 0; --j) {
+            result.Multiply(result);
+            if ((e >> j) & 1)
+                result.Multiply(*this);
+        }
+    }
+    return result;
+}
+
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char key[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(key);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    for (uint32_t i = 0; i < Num3072::BYTE_SIZE / CSHA256::OUTPUT_SIZE; ++i) {
+        unsigned char counter[4];
+        WriteLE32(counter, i);
+        CSHA256().Write(key, sizeof(key)).Write(counter, sizeof(counter)).Finalize(bytes + i * CSHA256::OUTPUT_SIZE);
+    }
+    return Num3072(bytes);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& other)
+{
+    numerator.Multiply(other.numerator);
+    denominator.Multiply(other.denominator);
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char out[32]) const
+{
+    Num3072 result = denominator.GetInverse();
+    result.Multiply(numerator);
+    unsigned char bytes[Num3072::BYTE_SIZE];
+    result.ToBytes(bytes);
+    CSHA256().Write(bytes, sizeof(bytes)).Finalize(out);
+}
+
+void MuHash3072::ToBytes(unsigned char* out) const
+{
+    numerator.ToBytes(out);
+    denominator.ToBytes(out + Num3072::BYTE_SIZE);
+}
+
+void MuHash3072::FromBytes(const unsigned char* in)
+{
+    numerator = Num3072(in);
+    denominator = Num3072(in + Num3072::BYTE_SIZE);
+}
@@ -0,0 +1,83 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** A number modulo the prime 2^3072 - 1103717, always kept fully reduced. */
+class Num3072
+{
+public:
+#if defined(__SIZEOF_INT128__)
+    typedef uint64_t limb_t;
+    typedef unsigned __int128 double_limb_t;
+    static const int LIMB_SIZE = 64;
+    static const int LIMBS = 48;
+#else
+    typedef uint32_t limb_t;
+    typedef uint64_t double_limb_t;
+    static const int LIMB_SIZE = 32;
+    static const int LIMBS = 96;
+#endif
+    static const size_t BYTE_SIZE = 384;
+
+    //! Little-endian limbs
+    limb_t limbs[LIMBS];
+
+    Num3072() { SetToOne(); }
+    //! Set to the little-endian number in the BYTE_SIZE bytes at data, reduced modulo the prime
+    explicit Num3072(const unsigned char* data);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    //! The multiplicative inverse, which must exist (the number is not zero)
+    Num3072 GetInverse() const;
+    //! Write BYTE_SIZE little-endian bytes
+    void ToBytes(unsigned char* out) const;
+};
+
+/**
+ * A rolling hash of a set of byte strings: MuHash over the group of numbers
+ * modulo 2^3072 - 1103717. Each element is hashed to a number, and the set
+ * hash is their product, so elements can be added and removed in any order.
+ * Finding a different set with the same product is as hard as the discrete
+ * logarithm in that group, unlike with a sum of hashes.
+ *
+ * The product of added and of removed elements are kept apart, so updates
+ * need one multiplication; the single inversion happens in Finalize.
+ *
+ * Elements are expanded to 384 bytes with SHA256 in counter mode, keyed by
+ * the SHA256 of the element.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+
+public:
+    static const size_t SERIALIZED_SIZE = 2 * Num3072::BYTE_SIZE;
+
+    //! The hash of the empty set
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+    //! Combine with the hash of a disjoint set
+    MuHash3072& operator*=(const MuHash3072& other);
+
+    //! Write the 32-byte digest of the set
+    void Finalize(unsigned char out[32]) const;
+
+    //! Write or read the state as SERIALIZED_SIZE bytes
+    void ToBytes(unsigned char* out) const;
+    void FromBytes(const unsigned char* in);
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
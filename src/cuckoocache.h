@@ -0,0 +1,125 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CUCKOOCACHE_H
+#define BITCOIN_CUCKOOCACHE_H
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Fixed-size set of hashed keys, organized as a cuckoo hash table.
+ *
+ * Every element can live in one of eight slots, picked by the eight 32-bit
+ * hashes that Hash::operator()(e, n) returns for n in [0, 8). Lookups probe
+ * those slots and never allocate. Inserting into a full neighbourhood moves
+ * an occupant to one of its other slots, up to a bounded number of times;
+ * whatever is still displaced after that is dropped. Because the hashes are
+ * expected to be salted, which element gets dropped cannot be predicted by
+ * an attacker, so this doubles as random eviction.
+ *
+ * The table is sized once with setup() or setup_bytes() and never grows.
+ * contains() may run concurrently with other contains() calls; insert() and
+ * setup() need exclusive access.
+ */
+template <typename Element, typename Hash>
+class CuckooCache
+{
+private:
+    static const unsigned int HASH_COUNT = 8;
+
+    std::vector<Element> table;
+    std::vector<bool> occupied;
+    uint32_t size;
+    unsigned int nDepthLimit;
+    //! Which of the eight slots the next displacement evicts from
+    unsigned int nNextEvict;
+    Hash hash_function;
+
+    uint32_t Slot(const Element& e, unsigned int n) const
+    {
+        // Map a 32-bit hash uniformly onto [0, size) without a division.
+        return (uint32_t)(((uint64_t)hash_function(e, n) * (uint64_t)size) >> 32);
+    }
+
+public:
+    CuckooCache() : size(0), nDepthLimit(0), nNextEvict(0) {}
+
+    /** Resize to hold new_size elements, dropping all current contents. Returns the new size. */
+    uint32_t setup(uint32_t new_size)
+    {
+        size = std::max((uint32_t)2, new_size);
+        // Deeper chains fill the table more completely but make a
+        // worst-case insert more expensive; log2(size) balances both.
+        nDepthLimit = 0;
+        for (uint32_t n = size; n > 1; n >>= 1)
+            nDepthLimit++;
+        table.assign(size, Element());
+        occupied.assign(size, false);
+        nNextEvict = 0;
+        return size;
+    }
+
+    /** Resize to fit within a memory budget in bytes. Returns the number of elements. */
+    uint32_t setup_bytes(size_t bytes)
+    {
+        size_t nElems = bytes / sizeof(Element);
+        return setup((uint32_t)std::min(nElems, (size_t)0xffffffff));
+    }
+
+    /** Disable the cache; contains() returns false until setup() is called again. */
+    void clear()
+    {
+        table.clear();
+        occupied.clear();
+        size = 0;
+    }
+
+    uint32_t capacity() const { return size; }
+
+    bool contains(const Element& e) const
+    {
+        if (size == 0)
+            return false;
+        for (unsigned int n = 0; n < HASH_COUNT; n++) {
+            uint32_t pos = Slot(e, n);
+            if (occupied[pos] && table[pos] == e)
+                return true;
+        }
+        return false;
+    }
+
+    void insert(Element e)
+    {
+        if (size == 0)
+            return;
+        uint32_t locs[HASH_COUNT];
+        for (unsigned int n = 0; n < HASH_COUNT; n++)
+            locs[n] = Slot(e, n);
+        for (unsigned int n = 0; n < HASH_COUNT; n++) {
+            if (occupied[locs[n]] && table[locs[n]] == e)
+                return;
+        }
+        for (unsigned int depth = 0; depth < nDepthLimit; depth++) {
+            for (unsigned int n = 0; n < HASH_COUNT; n++) {
+                if (!occupied[locs[n]]) {
+                    table[locs[n]] = e;
+                    occupied[locs[n]] = true;
+                    return;
+                }
+            }
+            // All slots taken: swap e into one of them and try to rehome
+            // the element it displaced.
+            uint32_t pos = locs[nNextEvict];
+            nNextEvict = (nNextEvict + 1) % HASH_COUNT;
+            std::swap(table[pos], e);
+            for (unsigned int n = 0; n < HASH_COUNT; n++)
+                locs[n] = Slot(e, n);
+        }
+        // Still homeless after nDepthLimit moves; drop it.
+    }
+};
+
+#endif // BITCOIN_CUCKOOCACHE_H
@@ -31,8 +31,17 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    size_t size_estimate;
 
 public:
+    CLevelDBBatch() : size_estimate(0) {}
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
+    }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -47,6 +56,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        size_estimate += ssKey.size() + ssValue.size();
     }
 
     template <typename K>
@@ -58,7 +68,11 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        size_estimate += ssKey.size();
     }
+
+    //! Approximate number of bytes queued in this batch.
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 class CLevelDBWrapper
@@ -168,6 +182,20 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    //! Compact the on-disk representation of the keys in [key_begin, key_end].
+    template <typename K>
+    void CompactRange(const K& key_begin, const K& key_end)
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(ssKey1.GetSerializeSize(key_begin));
+        ssKey2.reserve(ssKey2.GetSerializeSize(key_end));
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(&ssKey1[0], ssKey1.size());
+        leveldb::Slice slKey2(&ssKey2[0], ssKey2.size());
+        pdb->CompactRange(&slKey1, &slKey2);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
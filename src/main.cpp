@@ -8,9 +8,12 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockprefetch.h"
+#include "blockstore.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsflush.h"
 #include "consensus/validation.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -30,6 +33,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -45,6 +49,8 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+/** Storage of the entries in mapBlockIndex (protected by cs_main) */
+static CBlockIndexArena blockIndexArena;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
@@ -199,6 +205,25 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /** Last block queued for input prefetching. Protected by cs_main. */
+    const CBlockIndex* pindexLastPrefetched = NULL;
+
+    /**
+     * Immutable copy of the last blocks of the active chain, so "getheaders"
+     * from peers that are close to our tip can be answered without cs_main.
+     * CBlockIndex entries are never freed and their header fields never change,
+     * so the pointers stay valid after the tip moves on. Rebuilt by UpdateTip()
+     * and cleared during initial block download.
+     */
+    struct CChainTailSnapshot {
+        //! vBlocks[i] is the active chain block at height vBlocks[0]->nHeight + i
+        std::vector<CBlockIndex*> vBlocks;
+        //! Index into vBlocks by block hash
+        boost::unordered_map<uint256, int, BlockHasher> mapOffset;
+    };
+    CCriticalSection cs_chainTailSnapshot;
+    boost::shared_ptr<const CChainTailSnapshot> pchainTailSnapshot;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -544,6 +569,32 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewFlusher *pcoinsflusher = NULL;
+
+/** Statistics of the UTXO set at the tip, updated as blocks are connected and disconnected (protected by cs_main). */
+static CCoinsStats utxoStatsTip;
+/** Whether utxoStatsTip is known; if not, it is only set again from a full scan of the chainstate. */
+static bool fUTXOStatsTip = false;
+
+bool GetUTXOStats(CCoinsStats& stats)
+{
+    AssertLockHeld(cs_main);
+    if (!fUTXOStatsTip)
+        return false;
+    stats = utxoStatsTip;
+    return true;
+}
+
+void SetUTXOStats(const CCoinsStats& stats)
+{
+    AssertLockHeld(cs_main);
+    assert(stats.hashBlock == pcoinsTip->GetBestBlock());
+    utxoStatsTip = stats;
+    // Not maintained incrementally
+    utxoStatsTip.nTransactions = 0;
+    fUTXOStatsTip = true;
+}
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -993,43 +1044,26 @@ const char *HasNotoriousInput(const CTransaction& tx, CCoinsViewCache& view)
     BOOST_FOREACH(const CTxIn txin, tx.vin)
     {
         const COutPoint &outpoint = txin.prevout;
-        const CCoins* coins = view.AccessCoins(outpoint.hash);
-        if (!coins)
+        const Coin& coin = view.AccessCoin(outpoint);
+        if (coin.IsSpent())
             break;
-        entryname = IsNotorious(coins->vout[outpoint.n].scriptPubKey);
+        entryname = IsNotorious(coin.out.scriptPubKey);
         if (entryname)
             return entryname;
     }
     return NULL;
 }
 
-static unsigned int TxSearchForLongChain(const CTransaction& tx, const CTxMemPool& pool, unsigned int nDepthLimit, unsigned int nDepth = 0)
+void LimitMempoolSize(CTxMemPool& pool, size_t limit)
 {
-    unsigned int nMaxDepth = nDepth;
-    for (size_t i = 0; i < tx.vin.size(); ++i)
-    {
-        COutPoint outpoint = tx.vin[i].prevout;
-        std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.find(outpoint.hash);
-        if (it == pool.mapTx.end())
-            // Already confirmed
-            continue;
-
-        const unsigned int nParentDepth = nDepth + 1;
-        if (nParentDepth == nDepthLimit)
-            return nParentDepth;
-
-        const CTransaction& txParent = it->second.GetTx();
-        const unsigned int nMaxParentDepth = TxSearchForLongChain(txParent, pool, nDepthLimit, nParentDepth);
-        if (nMaxParentDepth == nDepthLimit)
-            return nMaxParentDepth;
-        if (nMaxParentDepth > nMaxDepth)
-            nMaxDepth = nMaxParentDepth;
-    }
-    return nMaxDepth;
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(limit, &vNoSpendsRemaining);
+    BOOST_FOREACH(const COutPoint& removed, vNoSpendsRemaining)
+        pcoinsTip->Uncache(removed);
 }
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1106,26 +1140,20 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         {
         LOCK(pool.cs);
 
-        const int nDepthLimit = GetArg("-limitunconfdepth", DEFAULT_LIMIT_UNCONF_DEPTH);
-        if (nDepthLimit > 0) {
-            const unsigned int nMaxDepth = TxSearchForLongChain(tx, pool, nDepthLimit);
-            if (nMaxDepth >= (unsigned int)nDepthLimit) {
-                return error("AcceptToMemoryPool : rejecting transaction with long unconfirmed chain: %s", tx.GetHash().ToString());
-            }
-        }
-
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            if (view.HaveCoin(COutPoint(hash, i)))
+                return false;
+        }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
+        // Spent and missing outputs are indistinguishable in the per-output
+        // UTXO set, so a missing input is reported for both.
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1158,7 +1186,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
+        // Count the sigops up front; the mempool entry caches them for block assembly.
+        unsigned int nSigOps = GetLegacySigOpCount(tx);
+        nSigOps += GetP2SHSigOpCount(tx, view);
+
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), nSigOps);
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -1166,8 +1198,6 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // itself can contain sigops MAX_STANDARD_TX_SIGOPS is less than
         // MAX_BLOCK_SIGOPS; we still consider this an invalid rather than
         // merely non-standard transaction.
-        unsigned int nSigOps = GetLegacySigOpCount(tx);
-        nSigOps += GetP2SHSigOpCount(tx, view);
         if ((nSigOps > MAX_STANDARD_TX_SIGOPS) || (nBytesPerSigOp && nSigOps > nSize / nBytesPerSigOp))
             return state.DoS(0,
                              error("AcceptToMemoryPool: too many sigops %s (%d)",
@@ -1181,6 +1211,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1216,9 +1252,27 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                        nFees, ::minRelayTxFee.GetFee(nSize) * 10000),
                                  REJECT_HIGHFEE, "absurdly-high-fee");
 
+        // Calculate in-mempool ancestors, up to a limit. The cached ancestor
+        // and descendant state of each entry bounds this walk; a non-zero
+        // -limitunconfdepth further caps the length of unconfirmed chains.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        const int nDepthLimit = GetArg("-limitunconfdepth", DEFAULT_LIMIT_UNCONF_DEPTH);
+        if (nDepthLimit > 0)
+            nLimitAncestors = std::min(nLimitAncestors, (size_t)nDepthLimit);
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: rejecting transaction %s: %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata))
         {
             return error("AcceptToMemoryPool: ConnectInputs failed %s", hash.ToString());
         }
@@ -1232,13 +1286,21 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
         {
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+            if (!pool.exists(hash))
+                return state.DoS(0, error("AcceptToMemoryPool: mempool full, %s evicted", hash.ToString()),
+                                 REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1282,10 +1344,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -1324,8 +1385,12 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::M
     if (fileout.IsNull())
         return error("WriteBlockToDisk: OpenBlockFile failed");
 
+    // Serialize once, for the file and for the block cache
+    CDataStream ssBlock(SER_DISK, CLIENT_VERSION);
+    ssBlock << block;
+
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
+    unsigned int nSize = ssBlock.size();
     fileout << FLATDATA(messageStart) << nSize;
 
     // Write block
@@ -1333,7 +1398,10 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::M
     if (fileOutPos < 0)
         return error("WriteBlockToDisk: ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    fileout.write(&ssBlock[0], ssBlock.size());
+
+    // Blocks just written are about to be connected and relayed
+    blockFileStore.AddBlock(pos, CBlockFileStore::BlockBytes(new std::vector<unsigned char>(ssBlock.begin(), ssBlock.end())));
 
     return true;
 }
@@ -1342,14 +1410,14 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    CBlockFileStore::BlockBytes pbytes;
+    if (!blockFileStore.ReadBlock(pos, Params().MessageStart(), pbytes))
+        return error("ReadBlockFromDisk: Unable to read block at %s", pos.ToString());
 
     // Read block
     try {
-        filein >> block;
+        CDataStream ssBlock(*pbytes, SER_DISK, CLIENT_VERSION);
+        ssBlock >> block;
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1372,6 +1440,20 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CBlockFileStore::BlockBytes pbytes;
+    if (!blockFileStore.ReadBlock(pos, messageStart, pbytes))
+        return error("ReadRawBlockFromDisk: Unable to read block at %s", pos.ToString());
+    block.assign(pbytes->begin(), pbytes->end());
+    return true;
+}
+
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    return ReadRawBlockFromDisk(block, pindex->GetBlockPos(), messageStart);
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     int halvings = nHeight / consensusParams.nSubsidyHalvingInterval;
@@ -1487,6 +1569,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1543,25 +1626,15 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
     // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight)
@@ -1572,13 +1645,13 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
     }
     return true;
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, const PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -1599,20 +1672,20 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
             // If prev is coinbase, check that it's matured
-            if (coins->IsCoinBase()) {
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY)
+            if (coin.IsCoinBase()) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY)
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -1643,11 +1716,11 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1659,8 +1732,8 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                        CScriptCheck check(coin.out, tx, i,
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1757,39 +1830,36 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            return error("%s: undo data adding output to missing transaction", __func__);
+        }
+    }
+    view.AddCoin(out, undo, !fClean);
 
     return fClean;
 }
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CCoinsStats* pstats)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1815,33 +1885,30 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || pindex->nHeight != (int)coin.nHeight || tx.IsCoinBase() != (bool)coin.fCoinBase) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+                if (is_spent && pstats)
+                    pstats->RemoveCoin(out, coin);
+            }
         }
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(txundo.vprevout[j], view, out))
                     fClean = false;
+                else if (pstats)
+                    pstats->AddCoin(out, txundo.vprevout[j]);
             }
         }
     }
@@ -1889,6 +1956,11 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+void ThreadBlockPrefetch() {
+    RenameThread("bitcoin-prefetch");
+    blockPrefetcher.Thread();
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -1957,7 +2029,7 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, CCoinsStats* pstats)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
@@ -2003,10 +2075,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                            (pindex->nHeight==91880 && pindex->GetBlockHash() == uint256S("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
         BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
-            if (coins && !coins->IsPruned())
-                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                                 REJECT_INVALID, "bad-txns-BIP30");
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                    return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                     REJECT_INVALID, "bad-txns-BIP30");
+                }
+            }
         }
     }
 
@@ -2030,6 +2104,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
+    // Queued script checks point into txdata, so it must not reallocate, and
+    // it must outlive control, whose destructor waits for those checks.
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size());
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
@@ -2070,17 +2149,40 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            txdata.push_back(PrecomputedTransactionData(tx));
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, txdata.back(), nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
 
+        if (pstats && !fEnforceBIP30) {
+            // The two duplicate coinbases replace unspent outputs
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                COutPoint out(tx.GetHash(), o);
+                const Coin& coin = view.AccessCoin(out);
+                if (!coin.IsSpent())
+                    pstats->RemoveCoin(out, coin);
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
+        if (pstats) {
+            if (i > 0) {
+                const CTxUndo& txundo = blockundo.vtxundo.back();
+                for (unsigned int j = 0; j < tx.vin.size(); j++)
+                    pstats->RemoveCoin(tx.vin[j].prevout, txundo.vprevout[j]);
+            }
+            for (unsigned int o = 0; o < tx.vout.size(); o++) {
+                if (!tx.vout[o].scriptPubKey.IsUnspendable())
+                    pstats->AddCoin(COutPoint(tx.GetHash(), o), Coin(tx.vout[o], pindex->nHeight, tx.IsCoinBase()));
+            }
+        }
+
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
@@ -2185,7 +2287,8 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     if (nLastSetChain == 0) {
         nLastSetChain = nNow;
     }
-    size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // The coins still being written in the background count against the limit too.
+    size_t cacheSize = pcoinsTip->DynamicMemoryUsage() + (pcoinsflusher ? pcoinsflusher->DynamicMemoryUsage() : 0);
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
@@ -2228,16 +2331,25 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // This only hands the changes to the background writer, unless we
+        // are asked to leave everything on disk. Recently used coins stay
+        // cached; only cold ones are evicted to make room.
+        if (!pcoinsTip->FlushAndTrim(nCoinCacheUsage / 100 * COIN_CACHE_TRIM_PERCENT))
+            return AbortNode(state, "Failed to write to coin database");
+        if (mode == FLUSH_STATE_ALWAYS && pcoinsflusher && !pcoinsflusher->Sync())
             return AbortNode(state, "Failed to write to coin database");
+        // The statistics name the best block they belong to. If they reach
+        // the disk before the coins do, they are just not used after a crash.
+        if (fUTXOStatsTip && !pblocktree->WriteUTXOStats(utxoStatsTip))
+            return AbortNode(state, "Failed to write to block index database");
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2278,6 +2390,23 @@ void static UpdateTip(CBlockIndex *pindexNew) {
 
     cvBlockChange.notify_all();
 
+    // Publish the new chain tail for the lock-free "getheaders" path.
+    boost::shared_ptr<CChainTailSnapshot> pSnapshot;
+    if (!IsInitialBlockDownload()) {
+        pSnapshot.reset(new CChainTailSnapshot());
+        int nStart = std::max(0, chainActive.Height() + 1 - (int)HEADERS_SNAPSHOT_DEPTH);
+        pSnapshot->vBlocks.reserve(chainActive.Height() + 1 - nStart);
+        pSnapshot->mapOffset.rehash(chainActive.Height() + 1 - nStart);
+        for (int nHeight = nStart; nHeight <= chainActive.Height(); nHeight++) {
+            pSnapshot->mapOffset[chainActive[nHeight]->GetBlockHash()] = pSnapshot->vBlocks.size();
+            pSnapshot->vBlocks.push_back(chainActive[nHeight]);
+        }
+    }
+    {
+        LOCK(cs_chainTailSnapshot);
+        pchainTailSnapshot = pSnapshot;
+    }
+
     // Check the version of the last 100 blocks to see if we need to upgrade:
     static bool fWarned = false;
     if (!IsInitialBlockDownload() && !fWarned)
@@ -2315,22 +2444,35 @@ bool static DisconnectTip(CValidationState &state) {
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        CCoinsStats statsNew = utxoStatsTip;
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, fUTXOStatsTip ? &statsNew : NULL))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
+        statsNew.hashBlock = pindexDelete->pprev->GetBlockHash();
+        statsNew.nHeight = pindexDelete->pprev->nHeight;
+        utxoStatsTip = statsNew;
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH(const CTransaction &tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+    // no in-mempool children, which is generally not true when adding
+    // previously-confirmed transactions back to the mempool.
+    // UpdateTransactionsFromBlock finds descendants of any transactions in this
+    // block that were added back and cleans up the mempool state.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -2371,7 +2513,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view);
+        CCoinsStats statsNew = utxoStatsTip;
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fUTXOStatsTip ? &statsNew : NULL);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2382,6 +2525,9 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
+        statsNew.hashBlock = pindexNew->GetBlockHash();
+        statsNew.nHeight = pindexNew->nHeight;
+        utxoStatsTip = statsNew;
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
@@ -2397,14 +2543,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
     // Tell wallet about transactions that went from mempool
-    // to conflicted:
-    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
-        SyncWithWallets(tx, NULL);
-    }
-    // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
-    }
+    // to conflicted, and about transactions that got confirmed:
+    SyncBlockWithWallets(*pblock, txConflicted);
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
@@ -2482,6 +2622,32 @@ static void PruneBlockIndexCandidates() {
     assert(!setBlockIndexCandidates.empty());
 }
 
+/**
+ * Queue the blocks that follow the tip on the way to pindexMostWork for input
+ * prefetching. Only done while catching up, when the next blocks are usually
+ * on disk already.
+ */
+static void PrefetchBlocksTowards(const CBlockIndex* pindexMostWork)
+{
+    AssertLockHeld(cs_main);
+    if (!IsInitialBlockDownload() || !blockPrefetcher.IsEnabled())
+        return;
+    blockPrefetcher.SetConnectedHeight(chainActive.Height());
+
+    // Continue where the last call left off if we are still on the same chain.
+    int nHeight = chainActive.Height() + 1;
+    if (pindexLastPrefetched && pindexMostWork->GetAncestor(pindexLastPrefetched->nHeight) == pindexLastPrefetched)
+        nHeight = std::max(nHeight, pindexLastPrefetched->nHeight + 1);
+    int nTargetHeight = std::min(pindexMostWork->nHeight, chainActive.Height() + PREFETCH_BLOCKS_AHEAD);
+    for (; nHeight <= nTargetHeight; nHeight++) {
+        const CBlockIndex* pindex = pindexMostWork->GetAncestor(nHeight);
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            break;
+        blockPrefetcher.Add(nHeight, pindex->GetBlockPos());
+        pindexLastPrefetched = pindex;
+    }
+}
+
 /**
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
@@ -2493,10 +2659,17 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
+    bool fBlocksDisconnected = false;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
         if (!DisconnectTip(state))
             return false;
+        fBlocksDisconnected = true;
     }
+    // Transactions resurrected by the disconnects bypassed the size limit.
+    if (fBlocksDisconnected)
+        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+
+    PrefetchBlocksTowards(pindexMostWork);
 
     // Build list of new blocks to connect.
     std::vector<CBlockIndex*> vpindexToConnect;
@@ -2685,8 +2858,7 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate(CBlockIndex(block));
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -2863,6 +3035,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 {
     // These are checks that are independent of context.
 
+    if (block.fChecked)
+        return true;
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
     if (!CheckBlockHeader(block, state, fCheckPOW))
@@ -2916,6 +3091,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops", true);
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
@@ -3223,6 +3401,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileStore.Invalidate(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3329,21 +3508,94 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     if (hash.IsNull())
         return NULL;
 
-    // Return existing
-    BlockMap::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    // Return existing, or create new; a single lookup either way
+    std::pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(hash, (CBlockIndex*)NULL));
+    if (!ret.second)
+        return ret.first->second;
 
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex(): new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    ret.first->second = pindexNew;
+    pindexNew->phashBlock = &ret.first->first;
 
     return pindexNew;
 }
 
+/** List the entries of mapBlockIndex by height, so that parents come before their
+ * children. As heights are dense, a counting sort does this in linear time. */
+static void SortBlockIndexByHeight(vector<CBlockIndex*>& vSortedByHeight)
+{
+    int nMaxHeight = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    vector<size_t> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightStart[nHeight] += vHeightStart[nHeight - 1];
+    vSortedByHeight.assign(mapBlockIndex.size(), NULL);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+}
+
+/** Set nChainWork and pskip of all entries from a cache saved at the last clean
+ * shutdown. Fails without changing anything if the cache does not describe
+ * exactly the entries that were loaded. */
+static bool ApplyBlockIndexCache(const CBlockIndexCache& cache, vector<CBlockIndex*>& vSortedByHeight)
+{
+    size_t nSize = cache.vHash.size();
+    if (cache.nVersion != CBlockIndexCache::CURRENT_VERSION || nSize != mapBlockIndex.size() ||
+        cache.vChainWork.size() != nSize || cache.vSkip.size() != nSize)
+        return false;
+
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(nSize);
+    for (size_t i = 0; i < nSize; i++) {
+        BlockMap::const_iterator mi = mapBlockIndex.find(cache.vHash[i]);
+        if (mi == mapBlockIndex.end())
+            return false;
+        CBlockIndex* pindex = mi->second;
+        // Parents and skip targets must come first
+        if (!vIndex.empty() && vIndex.back()->nHeight > pindex->nHeight)
+            return false;
+        if (cache.vSkip[i] != CBlockIndexCache::NO_SKIP && (cache.vSkip[i] >= i || vIndex[cache.vSkip[i]]->nHeight >= pindex->nHeight))
+            return false;
+        vIndex.push_back(pindex);
+    }
+
+    for (size_t i = 0; i < nSize; i++) {
+        vIndex[i]->nChainWork = UintToArith256(cache.vChainWork[i]);
+        vIndex[i]->pskip = cache.vSkip[i] == CBlockIndexCache::NO_SKIP ? NULL : vIndex[cache.vSkip[i]];
+    }
+    vSortedByHeight.swap(vIndex);
+    return true;
+}
+
+bool WriteBlockIndexCache()
+{
+    LOCK(cs_main);
+    vector<CBlockIndex*> vSortedByHeight;
+    SortBlockIndexByHeight(vSortedByHeight);
+
+    // Positions of the entries, to store the skip pointers
+    std::map<const CBlockIndex*, uint32_t> mapPos;
+    CBlockIndexCache cache;
+    cache.vHash.reserve(vSortedByHeight.size());
+    cache.vChainWork.reserve(vSortedByHeight.size());
+    cache.vSkip.reserve(vSortedByHeight.size());
+    BOOST_FOREACH(const CBlockIndex* pindex, vSortedByHeight) {
+        uint32_t nSkip = CBlockIndexCache::NO_SKIP;
+        if (pindex->pskip)
+            nSkip = mapPos[pindex->pskip];
+        mapPos[pindex] = cache.vHash.size();
+        cache.vHash.push_back(pindex->GetBlockHash());
+        cache.vChainWork.push_back(ArithToUint256(pindex->nChainWork));
+        cache.vSkip.push_back(nSkip);
+    }
+    if (!pblocktree->WriteBlockIndexCache(cache))
+        return error("%s: failed to write the block index cache", __func__);
+    return true;
+}
+
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
@@ -3352,19 +3604,26 @@ bool static LoadBlockIndexDB()
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // Take nChainWork and the skip pointers from the cache written at the last
+    // clean shutdown, if it matches the loaded entries. It is removed right
+    // away, as it goes stale as soon as the block index changes.
+    vector<CBlockIndex*> vSortedByHeight;
+    bool fCached;
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        CBlockIndexCache cache;
+        fCached = pblocktree->ReadBlockIndexCache(cache) && ApplyBlockIndexCache(cache, vSortedByHeight);
+        pblocktree->EraseBlockIndexCache();
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    if (!fCached)
+        SortBlockIndexByHeight(vSortedByHeight);
+    LogPrintf("%s: block index cache %s\n", __func__, fCached ? "used" : "not available, recomputing chain work");
+
+    // Calculate nChainWork. Parents are processed before their children, by
+    // going through the entries by height.
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        if (!fCached)
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
         if (pindex->nTx > 0) {
@@ -3383,7 +3642,7 @@ bool static LoadBlockIndexDB()
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
+        if (pindex->pprev && !fCached)
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
@@ -3438,6 +3697,14 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Load the UTXO set statistics, if they match the chainstate
+    CCoinsStats stats;
+    if (pblocktree->ReadUTXOStats(stats) ? stats.hashBlock == pcoinsTip->GetBestBlock() : pcoinsTip->GetBestBlock().IsNull()) {
+        utxoStatsTip = stats;
+        fUTXOStatsTip = true;
+    }
+    LogPrintf("%s: UTXO set statistics %s\n", __func__, fUTXOStatsTip ? "loaded" : "unavailable until the next scan");
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3488,6 +3755,11 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        // Pruned nodes, and nodes started from a UTXO snapshot, only have the most recent blocks
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("VerifyDB(): block data is not available below height %d\n", pindex->nHeight + 1);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3565,11 +3837,13 @@ void UnloadBlockIndex()
     setDirtyFileInfo.clear();
     mapNodeState.clear();
     recentRejects.reset(NULL);
+    blockFileStore.Clear();
+    pindexLastPrefetched = NULL;
+    utxoStatsTip = CCoinsStats();
+    fUTXOStatsTip = false;
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
 }
 
@@ -3627,6 +3901,69 @@ bool InitBlockIndex() {
 
 
 
+namespace {
+/** A block found in an external block file, deserialized and checked ahead of processing. */
+struct CImportedBlock {
+    //! Position of the message start that precedes the block in the file
+    uint64_t nHeaderPos;
+    //! Position and size of the serialized block in the file
+    uint64_t nBlockPos;
+    unsigned int nSize;
+    std::vector<char> vchBlock;
+    //! Number of bytes the block was deserialized from; 0 if that failed
+    unsigned int nParsedSize;
+    boost::shared_ptr<CBlock> pblock;
+
+    CImportedBlock() : nHeaderPos(0), nBlockPos(0), nSize(0), nParsedSize(0) {}
+};
+
+/**
+ * Closure representing the deserialization and context-free checks of one
+ * imported block. A block that passes is marked fChecked, so ProcessNewBlock
+ * does not check it again; failures are reported when it is processed.
+ */
+class CImportBlockCheck
+{
+private:
+    CImportedBlock* pentry;
+
+public:
+    CImportBlockCheck() : pentry(NULL) {}
+    CImportBlockCheck(CImportedBlock* pentryIn) : pentry(pentryIn) {}
+
+    bool operator()()
+    {
+        boost::shared_ptr<CBlock> pblock(new CBlock());
+        try {
+            CDataStream ssBlock(pentry->vchBlock, SER_DISK, CLIENT_VERSION);
+            ssBlock >> *pblock;
+            pentry->nParsedSize = pentry->nSize - ssBlock.size();
+        } catch (const std::exception& e) {
+            LogPrintf("LoadExternalBlockFile: Deserialize error - %s\n", e.what());
+            return true;
+        }
+        pentry->pblock = pblock;
+        std::vector<char>().swap(pentry->vchBlock);
+        CValidationState state;
+        CheckBlock(*pblock, state);
+        return true;
+    }
+
+    void swap(CImportBlockCheck& check)
+    {
+        std::swap(pentry, check.pentry);
+    }
+};
+
+/** Queue for deserializing and checking imported blocks; only used by the import thread. */
+CCheckQueue<CImportBlockCheck> importcheckqueue(8);
+} // anon namespace
+
+void ThreadImportCheck() {
+    RenameThread("bitcoin-importch");
+    importcheckqueue.Thread();
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     const CChainParams& chainparams = Params();
@@ -3639,87 +3976,167 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        bool fEnd = false;
+        while (!fEnd && !blkdat.eof()) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+            // Read a batch of blocks...
+            std::vector<CImportedBlock> vBatch;
+            uint64_t nBatchSize = 0;
+            while (vBatch.size() < MAX_IMPORT_BATCH_BLOCKS && nBatchSize < MAX_IMPORT_BATCH_SIZE && !blkdat.eof()) {
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                uint64_t nHeaderPos = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nHeaderPos = blkdat.GetPos();
+                    nRewind = nHeaderPos+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (const std::exception&) {
+                    // no valid block header found; don't complain
+                    fEnd = true;
+                    break;
+                }
+                try {
+                    // read block
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    blkdat.SetPos(nBlockPos);
+                    std::vector<char> vchBlock(nSize);
+                    blkdat.read(&vchBlock[0], nSize);
+                    nRewind = blkdat.GetPos();
+
+                    vBatch.push_back(CImportedBlock());
+                    CImportedBlock& entry = vBatch.back();
+                    entry.nHeaderPos = nHeaderPos;
+                    entry.nBlockPos = nBlockPos;
+                    entry.nSize = nSize;
+                    entry.vchBlock.swap(vchBlock);
+                    nBatchSize += nSize;
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                }
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
+
+            // ...deserialize and check them on all script verification threads...
+            {
+                std::vector<CImportBlockCheck> vChecks;
+                vChecks.reserve(vBatch.size());
+                BOOST_FOREACH(CImportedBlock& entry, vBatch) {
+                    CImportBlockCheck check(&entry);
+                    vChecks.push_back(CImportBlockCheck());
+                    check.swap(vChecks.back());
                 }
+                CCheckQueueControl<CImportBlockCheck> control(&importcheckqueue);
+                control.Add(vChecks);
+                control.Wait();
+            }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, true, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+            // ...let the prefetch threads look up the inputs of those that connect...
+            if (blockPrefetcher.IsEnabled()) {
+                LOCK(cs_main);
+                std::map<uint256, int> mapBatchHeight;
+                BOOST_FOREACH(const CImportedBlock& entry, vBatch) {
+                    if (!entry.pblock)
+                        continue;
+                    int nHeight;
+                    BlockMap::iterator mi = mapBlockIndex.find(entry.pblock->hashPrevBlock);
+                    std::map<uint256, int>::iterator it = mapBatchHeight.find(entry.pblock->hashPrevBlock);
+                    if (mi != mapBlockIndex.end())
+                        nHeight = mi->second->nHeight + 1;
+                    else if (it != mapBatchHeight.end())
+                        nHeight = it->second + 1;
+                    else
+                        continue;
+                    mapBatchHeight[entry.pblock->GetHash()] = nHeight;
+                    blockPrefetcher.Add(nHeight, boost::shared_ptr<const CBlock>(entry.pblock));
                 }
+            }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
-                        {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, true, &it->second))
-                            {
+            // ...and process them in file order.
+            for (unsigned int i = 0; i < vBatch.size(); i++) {
+                boost::this_thread::interruption_point();
+
+                const CImportedBlock& entry = vBatch[i];
+                if (entry.nParsedSize != entry.nSize) {
+                    // Look for the next block right after this one, or one byte past its
+                    // header if it could not be read at all; the rest of the batch is read again.
+                    nRewind = entry.pblock ? entry.nBlockPos + entry.nParsedSize : entry.nHeaderPos + 1;
+                    if (!blkdat.SetPos(nRewind))
+                        blkdat.Seek(nRewind);
+                    fEnd = false;
+                    if (!entry.pblock)
+                        break;
+                }
+                if (dbp)
+                    dbp->nPos = entry.nBlockPos;
+
+                try {
+                    CBlock& block = *entry.pblock;
+
+                    // detect out of order blocks, and store them for later
+                    uint256 hash = block.GetHash();
+                    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                                block.hashPrevBlock.ToString());
+                        if (dbp)
+                            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                    } else {
+                        // process in case the block isn't known yet
+                        if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                            CValidationState state;
+                            if (ProcessNewBlock(state, NULL, &block, true, dbp))
                                 nLoaded++;
-                                queue.push_back(block.GetHash());
+                            if (state.IsError()) {
+                                fEnd = true;
+                                break;
+                            }
+                        } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                            LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+                        }
+
+                        // Recursively process earlier encountered successors of this block
+                        deque<uint256> queue;
+                        queue.push_back(hash);
+                        while (!queue.empty()) {
+                            uint256 head = queue.front();
+                            queue.pop_front();
+                            std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                            while (range.first != range.second) {
+                                std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                                CBlock blockChild;
+                                if (ReadBlockFromDisk(blockChild, it->second))
+                                {
+                                    LogPrintf("%s: Processing out of order child %s of %s\n", __func__, blockChild.GetHash().ToString(),
+                                            head.ToString());
+                                    CValidationState dummy;
+                                    if (ProcessNewBlock(dummy, NULL, &blockChild, true, &it->second))
+                                    {
+                                        nLoaded++;
+                                        queue.push_back(blockChild.GetHash());
+                                    }
+                                }
+                                range.first++;
+                                mapBlocksUnknownParent.erase(it);
                             }
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
                     }
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+
+                if (entry.nParsedSize != entry.nSize)
+                    break;
             }
         }
     } catch (const std::runtime_error& e) {
@@ -3730,6 +4147,236 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+namespace {
+/** Format version of UTXO set snapshot files */
+static const int UTXO_SNAPSHOT_VERSION = 2;
+/** Number of coins written to the coin database per batch while loading a snapshot */
+static const unsigned int UTXO_SNAPSHOT_BATCH_COINS = 100000;
+
+/** Remove all coins from the coin database, undoing a snapshot load that failed */
+bool WipeSnapshotCoins()
+{
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor(pcoinsdbview->Cursor());
+    CCoinsMap mapCoins;
+    while (pcursor->Valid()) {
+        COutPoint outpoint;
+        Coin coin;
+        if (!pcursor->GetEntry(outpoint, coin))
+            return false;
+        // A spent dirty entry erases the record
+        mapCoins[outpoint].flags = CCoinsCacheEntry::DIRTY;
+        if (mapCoins.size() >= UTXO_SNAPSHOT_BATCH_COINS) {
+            if (!pcoinsdbview->BatchWrite(mapCoins, uint256()))
+                return false;
+            mapCoins.clear();
+        }
+        pcursor->Next();
+    }
+    return pcoinsdbview->BatchWrite(mapCoins, uint256());
+}
+} // anon namespace
+
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CCoinsStats& stats, uint256& hashSnapshot)
+{
+    boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    CAutoFile fileout(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s: Failed to open %s", __func__, pathTmp.string());
+
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor;
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    try {
+        LOCK(cs_main);
+        // The cursor sees the coin database as of its creation, so only the
+        // headers need to be written while holding cs_main.
+        FlushStateToDisk();
+        CBlockIndex* pindexBase = chainActive.Tip();
+        if (pcoinsdbview->GetBestBlock() != pindexBase->GetBlockHash())
+            return error("%s: Failed to flush the chainstate", __func__);
+        pcursor.reset(pcoinsdbview->Cursor());
+        stats = CCoinsStats();
+        stats.hashBlock = pindexBase->GetBlockHash();
+        stats.nHeight = pindexBase->nHeight;
+
+        fileout << FLATDATA(Params().MessageStart()) << UTXO_SNAPSHOT_VERSION << stats.hashBlock << stats.nHeight;
+        hasher << stats.hashBlock << stats.nHeight;
+        for (int nHeight = 1; nHeight <= stats.nHeight; nHeight++) {
+            const CBlockIndex* pindex = chainActive[nHeight];
+            fileout << pindex->GetBlockHeader() << VARINT(pindex->nTx);
+            hasher << pindex->GetBlockHeader() << VARINT(pindex->nTx);
+        }
+    } catch (const std::exception& e) {
+        return error("%s: I/O error - %s", __func__, e.what());
+    }
+
+    try {
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            COutPoint outpoint;
+            Coin coin;
+            if (!pcursor->GetEntry(outpoint, coin))
+                return error("%s: Unable to read the coin database", __func__);
+            fileout << outpoint << coin;
+            hasher << outpoint << coin;
+            stats.AddCoin(outpoint, coin);
+            pcursor->Next();
+        }
+        // A null outpoint ends the coins
+        hashSnapshot = hasher.GetHash();
+        fileout << COutPoint() << stats.nTransactionOutputs << hashSnapshot;
+        FileCommit(fileout.Get());
+    } catch (const std::exception& e) {
+        return error("%s: I/O error - %s", __func__, e.what());
+    }
+    fileout.fclose();
+    if (!RenameOver(pathTmp, path))
+        return error("%s: Rename-into-place failed", __func__);
+
+    LogPrintf("%s: Wrote %u coins of block %s (height %d) to %s\n", __func__,
+        stats.nTransactionOutputs, stats.hashBlock.ToString(), stats.nHeight, path.string());
+    return true;
+}
+
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, const uint256& hashExpected)
+{
+    const CChainParams& chainparams = Params();
+    LOCK(cs_main);
+    if (chainActive.Height() != 0 || pcoinsTip->GetBestBlock() != chainparams.GetConsensus().hashGenesisBlock)
+        return error("%s: The chainstate is not empty", __func__);
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: Failed to open %s", __func__, path.string());
+    // Make sure no write is in flight below pcoinsTip
+    FlushStateToDisk();
+
+    // Coins left behind by an interrupted load may come from another
+    // snapshot than this one, so start over from an empty coin database.
+    bool fSnapshotLoading = false;
+    if (pblocktree->ReadFlag("utxosnapshotloading", fSnapshotLoading) && fSnapshotLoading) {
+        LogPrintf("%s: Removing the coins of an interrupted snapshot load\n", __func__);
+        if (!WipeSnapshotCoins())
+            return AbortNode("Failed to write to coin database");
+        if (!pblocktree->WriteFlag("utxosnapshotloading", false))
+            return AbortNode("Failed to write to block index database");
+    }
+
+    int64_t nStart = GetTimeMillis();
+    CCoinsStats stats;
+    // Everything the snapshot claims is hashed in file order, starting with
+    // the base block, so hashExpected vouches for the coins at that block.
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    std::vector<std::pair<CBlockIndex*, unsigned int> > vHeaders;
+    try {
+        unsigned char buf[MESSAGE_START_SIZE];
+        int nVersion;
+        filein >> FLATDATA(buf) >> nVersion >> stats.hashBlock >> stats.nHeight;
+        if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+            return error("%s: Snapshot is for a different network", __func__);
+        if (nVersion != UTXO_SNAPSHOT_VERSION)
+            return error("%s: Unsupported snapshot version %d", __func__, nVersion);
+        if (stats.nHeight <= 0)
+            return error("%s: Snapshot is not based on a block after the genesis block", __func__);
+        LogPrintf("Loading UTXO snapshot of block %s (height %d)...\n", stats.hashBlock.ToString(), stats.nHeight);
+        hasher << stats.hashBlock << stats.nHeight;
+
+        // The headers must lead from the genesis block to the snapshot base,
+        // and pass the same checks as headers received from peers.
+        CBlockIndex* pindexPrev = chainActive.Genesis();
+        for (int nHeight = 1; nHeight <= stats.nHeight; nHeight++) {
+            CBlockHeader header;
+            unsigned int nTx;
+            filein >> header >> VARINT(nTx);
+            hasher << header << VARINT(nTx);
+            if (header.hashPrevBlock != pindexPrev->GetBlockHash() || nTx == 0)
+                return error("%s: Headers do not form a chain at height %d", __func__, nHeight);
+            CValidationState state;
+            CBlockIndex* pindex = NULL;
+            if (!AcceptBlockHeader(header, state, &pindex))
+                return error("%s: Invalid header at height %d: %s", __func__, nHeight, state.GetRejectReason());
+            vHeaders.push_back(std::make_pair(pindex, nTx));
+            pindexPrev = pindex;
+        }
+        if (pindexPrev->GetBlockHash() != stats.hashBlock)
+            return error("%s: Headers do not end at the snapshot base", __func__);
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    // The coins are stored in database order, so every batch covers a
+    // contiguous range of keys. A restart while loading leaves the coins
+    // written so far behind; the flag makes the next load wipe them and
+    // start over.
+    if (!pblocktree->WriteFlag("utxosnapshotloading", true))
+        return AbortNode("Failed to write to block index database");
+    bool fOk = false;
+    try {
+        CCoinsMap mapCoins;
+        while (true) {
+            COutPoint outpoint;
+            filein >> outpoint;
+            if (outpoint.IsNull())
+                break;
+            CCoinsCacheEntry& entry = mapCoins[outpoint];
+            filein >> entry.coin;
+            hasher << outpoint << entry.coin;
+            entry.flags = CCoinsCacheEntry::DIRTY;
+            stats.AddCoin(outpoint, entry.coin);
+            if (mapCoins.size() >= UTXO_SNAPSHOT_BATCH_COINS) {
+                if (!pcoinsdbview->BatchWrite(mapCoins, uint256()))
+                    return AbortNode("Failed to write to coin database");
+                mapCoins.clear();
+                if (ShutdownRequested())
+                    return false;
+            }
+        }
+        if (!pcoinsdbview->BatchWrite(mapCoins, uint256()))
+            return AbortNode("Failed to write to coin database");
+
+        uint64_t nCoins;
+        uint256 hashStored;
+        filein >> nCoins >> hashStored;
+        const uint256 hashSnapshot = hasher.GetHash();
+        if (nCoins != stats.nTransactionOutputs || hashStored != hashSnapshot)
+            LogPrintf("%s: Snapshot is corrupted\n", __func__);
+        else if (hashSnapshot != hashExpected)
+            LogPrintf("%s: Snapshot hash %s does not match the expected %s\n", __func__, hashSnapshot.ToString(), hashExpected.ToString());
+        else
+            fOk = true;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+    }
+    if (!fOk) {
+        if (!WipeSnapshotCoins())
+            return AbortNode("Failed to write to coin database");
+        if (!pblocktree->WriteFlag("utxosnapshotloading", false))
+            return AbortNode("Failed to write to block index database");
+        return false;
+    }
+
+    // Make the snapshot base the tip. The blocks below it are missing, as on
+    // a pruned node, but their transaction counts are known from the snapshot.
+    BOOST_FOREACH(const PAIRTYPE(CBlockIndex*, unsigned int)& item, vHeaders) {
+        item.first->nTx = item.second;
+        item.first->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(item.first);
+    }
+    if (!pblocktree->WriteFlag("prunedblockfiles", true) || !pblocktree->WriteFlag("utxosnapshot", true))
+        return AbortNode("Failed to write to block index database");
+    pcoinsTip->SetBestBlock(stats.hashBlock);
+    SetUTXOStats(stats);
+    FlushStateToDisk();
+    if (!pblocktree->WriteFlag("utxosnapshotloading", false))
+        return AbortNode("Failed to write to block index database");
+
+    // Rebuild the in-memory block index from the databases, as at startup
+    UnloadBlockIndex();
+    if (!LoadBlockIndex() || !InitBlockIndex())
+        return error("%s: Failed to reload the block index", __func__);
+
+    LogPrintf("Loaded UTXO snapshot with %u coins in %dms\n", stats.nTransactionOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
 void static CheckBlockIndex()
 {
     const Consensus::Params& consensusParams = Params().GetConsensus();
@@ -4005,7 +4652,9 @@ bool static AlreadyHave(const CInv& inv)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) ||
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4058,13 +4707,19 @@ void static ProcessGetData(CNode* pfrom)
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
                     // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        // The stored bytes are already the network serialization
+                        std::vector<unsigned char> vchBlock;
+                        if (!ReadRawBlockFromDisk(vchBlock, (*mi).second, Params().MessageStart()))
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("block", CFlatData(vchBlock));
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -4222,7 +4877,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -4384,10 +5042,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return error("message inv size() = %u", vInv.size());
         }
 
-        LOCK(cs_main);
-
-        std::vector<CInv> vToFetch;
-
+        // Do the per-peer bookkeeping first, and settle transactions that are
+        // already in the mempool, without cs_main. Only what is left needs
+        // the chain state.
+        std::vector<CInv> vInvPending;
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
@@ -4396,6 +5054,31 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (!pfrom->AddInventoryKnown(inv))
                 continue;
 
+            if (inv.type == MSG_TX && mempool.exists(inv.hash)) {
+                LogPrint("net", "got inv: %s  have peer=%d\n", inv.ToString(), pfrom->id);
+                // Track requests for our stuff
+                GetMainSignals().Inventory(inv.hash);
+            } else {
+                vInvPending.push_back(inv);
+            }
+
+            if (pfrom->nSendSize > (SendBufferSize() * 2)) {
+                Misbehaving(pfrom->GetId(), 50);
+                return error("send buffer size() = %u", pfrom->nSendSize);
+            }
+        }
+        if (vInvPending.empty())
+            return true;
+
+        LOCK(cs_main);
+
+        std::vector<CInv> vToFetch;
+
+        for (unsigned int nInv = 0; nInv < vInvPending.size(); nInv++)
+        {
+            const CInv &inv = vInvPending[nInv];
+
+            boost::this_thread::interruption_point();
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
 
@@ -4487,7 +5170,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // If pruning, don't inv blocks unless we have on disk and are likely to still have
             // for some reasonable time window that block relay might require.
             const int nPrunedBlocksLikelyToHave = MIN_BLOCKS_TO_KEEP - 6;
-            if (fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Tip()->nHeight - nPrunedBlocksLikelyToHave))
+            if ((fPruneMode && (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nHeight <= chainActive.Tip()->nHeight - nPrunedBlocksLikelyToHave)) ||
+                (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)))
             {
                 LogPrint("net", " getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
@@ -4511,6 +5195,35 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
+        // Peers near our tip are served from the chain tail snapshot. This
+        // is only used when the first locator entry is in it, in which case
+        // FindForkInGlobalIndex would have picked that entry as well.
+        if (!locator.IsNull())
+        {
+            boost::shared_ptr<const CChainTailSnapshot> pSnapshot;
+            {
+                LOCK(cs_chainTailSnapshot);
+                pSnapshot = pchainTailSnapshot;
+            }
+            boost::unordered_map<uint256, int, BlockHasher>::const_iterator it;
+            if (pSnapshot && (it = pSnapshot->mapOffset.find(locator.vHave[0])) != pSnapshot->mapOffset.end())
+            {
+                unsigned int nStart = it->second + 1;
+                vector<CBlock> vHeaders;
+                int nLimit = MAX_HEADERS_RESULTS;
+                LogPrint("net", "getheaders %d to %s from peer=%d\n", (nStart < pSnapshot->vBlocks.size() ? pSnapshot->vBlocks[nStart]->nHeight : -1), hashStop.ToString(), pfrom->id);
+                for (unsigned int i = nStart; i < pSnapshot->vBlocks.size(); i++)
+                {
+                    const CBlockIndex* pindex = pSnapshot->vBlocks[i];
+                    vHeaders.push_back(pindex->GetBlockHeader());
+                    if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                        break;
+                }
+                pfrom->PushMessage("headers", vHeaders);
+                return true;
+            }
+        }
+
         LOCK(cs_main);
         if (IsInitialBlockDownload() && !pfrom->fWhitelisted) {
             LogPrint("net", "Ignoring getheaders from peer=%d because node is in initial block download\n", pfrom->id);
@@ -4765,7 +5478,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (!pfrom->fInbound)
             return true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4882,12 +5598,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert(Params().AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -5148,6 +5872,32 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
+        //
+        // Message: addr
+        //
+        if (fSendTrickle)
+        {
+            vector<CAddress> vAddr;
+            {
+                // Other peers' message handlers push into vAddrToSend.
+                LOCK(pto->cs_inventory);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+                {
+                    if (!pto->addrKnown.contains(addr.GetKey()))
+                    {
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddr.push_back(addr);
+                    }
+                }
+                pto->vAddrToSend.clear();
+            }
+            // PushAddress() caps vAddrToSend at MAX_ADDR_TO_SEND, which is
+            // no more than the receiver accepts in one addr message.
+            if (!vAddr.empty())
+                pto->PushMessage("addr", vAddr);
+        }
+
         TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
         if (!lockMain)
             return true;
@@ -5160,8 +5910,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_inventory);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5170,32 +5922,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 nLastRebroadcast = GetTime();
         }
 
-        //
-        // Message: addr
-        //
-        if (fSendTrickle)
-        {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
-            {
-                if (!pto->addrKnown.contains(addr.GetKey()))
-                {
-                    pto->addrKnown.insert(addr.GetKey());
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
-                }
-            }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
-        }
-
         CNodeState &state = *State(pto->GetId());
         if (state.fShouldBan) {
             if (pto->fWhitelisted)
@@ -5378,10 +6104,7 @@ class CMainCleanup
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
-        // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers, whose entries blockIndexArena frees
         mapBlockIndex.clear();
 
         // orphan transactions
@@ -15,12 +15,16 @@
 #include "pow.h"
 #include "primitives/transaction.h"
 #include "timedata.h"
+#include "txmempool.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
 #endif
 
+#include <algorithm>
+#include <utility>
+
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -33,190 +37,553 @@ using namespace std;
 
 //
 // Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// CTxInfo represents a logical transaction to potentially be included in blocks
-// It stores extra metadata such as the subjective priority of a transaction at
-// the time of building the block. When there are unconfirmed transactions that
-// depend on other unconfirmed transactions, these "child" transactions' CTxInfo
-// object factors in its "parents" to its priority and effective size; this way,
-// the "child" can cover the "cost" of its "parents", and the "parents" are
-// included into the block as part of the "child".
+// transactions in the memory pool. The mempool caches, for every entry, the
+// size, fees and sigops of the entry together with all of its in-mempool
+// ancestors, and indexes entries by that ancestor feerate. Block assembly
+// walks this index and adds each transaction together with the ancestors it
+// still needs (a "package"), so that a child paying a high fee carries its
+// low-fee parents into the block.
+//
+// Once some of a package's ancestors are in the block, the cached ancestor
+// state of the remaining descendants overstates their package; those entries
+// are tracked with corrected values in a separate indexed set instead.
+// Everything needed is already cached by the mempool, so no coins are looked
+// up while assembling; the template is still checked with TestBlockValidity.
 //
-class CTxInfo;
-typedef std::map<uint256, CTxInfo> mapInfo_t;
 
-class CTxInfo
-{
-public:
-    mapInfo_t *pmapInfoById;
-    const CTransaction* ptx;
-    uint256 hash;
-private:
-    set<uint256> setDependsOn;
-public:
-    set<uint256> setDependents;
-    double dPriority;
-    CAmount nTxFee;
-    int nTxSigOpsP2SHOnly;
-    bool fInvalid;
-    unsigned int nSize;
-    unsigned int nEffectiveSizeCached;
-
-    CTxInfo() : pmapInfoById(NULL), ptx(NULL), hash(), dPriority(0), nTxFee(0), fInvalid(false), nSize(0), nEffectiveSizeCached(0)
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+/** A mempool entry whose ancestor state is adjusted for ancestors already in the block. */
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
     {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+        nSigOpCountWithAncestors = entry->GetSigOpCountWithAncestors();
     }
 
-    void addDependsOn(const uint256& hashPrev)
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    unsigned int nSigOpCountWithAncestors;
+};
+
+// Comparator for CTxMemPool::txiter objects; the entries are never moved, so
+// their address is a cheap total order.
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        setDependsOn.insert(hashPrev);
-        nEffectiveSizeCached = 0;
+        return &(*a) < &(*b);
     }
+};
 
-    void rmDependsOn(const uint256& hashPrev)
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
     {
-        setDependsOn.erase(hashPrev);
-        nEffectiveSizeCached = 0;
+        return entry.iter;
     }
+};
 
-    // effectiveSize handles inheriting the fInvalid flag as a side effect
-    unsigned int effectiveSize()
+// Same ordering as CompareTxMemPoolEntryByAncestorFee, on the adjusted state.
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry &a, const CTxMemPoolModifiedEntry &b) const
     {
-        if (fInvalid)
-            return -1;
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2) {
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        }
+        return f1 > f2;
+    }
+};
 
-        if (nEffectiveSizeCached)
-            return nEffectiveSizeCached;
+// A transaction always has fewer in-mempool ancestors than any of its
+// descendants, so this sorts a package into a valid block order.
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
 
-        assert(pmapInfoById);
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter
+        >,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            // Reuse same tag from CTxMemPool's similar index
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry
+        >
+    >
+> indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion
+{
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
 
-        if (!nSize)
-            nSize = ::GetSerializeSize(*ptx, SER_NETWORK, PROTOCOL_VERSION);
-        unsigned int nEffectiveSize = nSize;
-        BOOST_FOREACH(const uint256& dephash, setDependsOn)
-        {
-            CTxInfo& depinfo = (*pmapInfoById)[dephash];
-            nEffectiveSize += depinfo.effectiveSize();
+    void operator() (CTxMemPoolModifiedEntry &e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+        e.nSigOpCountWithAncestors -= iter->GetSigOpCount();
+    }
 
-            if (depinfo.fInvalid)
-            {
-                fInvalid = true;
-                return -1;
-            }
-        }
-        nEffectiveSizeCached = nEffectiveSize;
-        return nEffectiveSize;
+    CTxMemPool::txiter iter;
+};
+
+// Priority order to process transactions in the high-priority area
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+
+class TxCoinAgePriorityCompare
+{
+public:
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByHash()(b.second, a.second);
+        return a.first < b.first;
     }
+};
+
+/** Fills a block template from the mempool; requires cs_main and mempool.cs. */
+class BlockAssembler
+{
+private:
+    CBlockTemplate* pblocktemplate;
+    CBlock* pblock;
+
+    // Configuration parameters for the block size
+    unsigned int nBlockMaxSize, nBlockMinSize, nBlockPrioritySize;
+    bool fPrintPriority;
+
+    // Information on the current status of the block
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+    CTxMemPool::setEntries inBlock;
+
+    // Chain context for the block
+    int nHeight;
+    int64_t nLockTimeCutoff;
+
+    // Variables used for addPriorityTxs
+    int lastFewTxs;
+    bool blockFinished;
+
+public:
+    BlockAssembler(CBlockTemplate* pblocktemplateIn, int nHeightIn, int64_t nLockTimeCutoffIn);
+
+    /** Add high-priority transactions, then packages by ancestor fee rate. */
+    void AddTransactions();
+
+    uint64_t GetBlockSize() const { return nBlockSize; }
+    uint64_t GetBlockTx() const { return nBlockTx; }
+    CAmount GetFees() const { return nFees; }
+
+private:
+    /** Add a tx to the block */
+    void AddToBlock(CTxMemPool::txiter iter);
+
+    /** Add transactions based on coin-age priority, up to -blockprioritysize */
+    void addPriorityTxs();
+    /** Add transactions based on feerate including unconfirmed ancestors */
+    void addPackageTxs();
+
+    /** Test if tx will still "fit" in the block */
+    bool TestForBlock(CTxMemPool::txiter iter);
+    /** Test if tx still has unconfirmed parents not yet in block */
+    bool isStillDependent(CTxMemPool::txiter iter);
+
+    /** Remove confirmed (inBlock) entries from given set */
+    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
+    /** Test if a new package would "fit" in the block */
+    bool TestPackage(uint64_t packageSize, unsigned int packageSigOps);
+    /** Test that all transactions in the package are final at the block height */
+    bool TestPackageFinality(const CTxMemPool::setEntries& package);
+    /** Return true if given transaction from mapTx has already been evaluated,
+      * or if the transaction's cached data in mapTx is incorrect. */
+    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
+    /** Add descendants of given transactions to mapModifiedTx with ancestor
+      * state updated assuming given transactions are inBlock. */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+};
+
+BlockAssembler::BlockAssembler(CBlockTemplate* pblocktemplateIn, int nHeightIn, int64_t nLockTimeCutoffIn)
+    : pblocktemplate(pblocktemplateIn), pblock(&pblocktemplateIn->block),
+      nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0),
+      nHeight(nHeightIn), nLockTimeCutoff(nLockTimeCutoffIn), lastFewTxs(0), blockFinished(false)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
-    unsigned int effectiveSizeMod()
+    fPrintPriority = GetBoolArg("-printpriority", false);
+}
+
+void BlockAssembler::AddTransactions()
+{
+    AssertLockHeld(mempool.cs);
+    addPriorityTxs();
+    addPackageTxs();
+}
+
+bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
+{
+    BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter))
     {
-        unsigned int nTxSizeMod = effectiveSize();
-        const CTransaction &tx = *ptx;
-        // In order to avoid disincentivizing cleaning up the UTXO set we don't count
-        // the constant overhead for each txin and up to 110 bytes of scriptSig (which
-        // is enough to cover a compressed pubkey p2sh redemption) for priority.
-        // Providing any more cleanup incentive than making additional inputs free would
-        // risk encouraging people to create junk outputs to redeem later.
-        BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        {
-            unsigned int offset = 41U + min(110U, (unsigned int)txin.scriptSig.size());
-            if (nTxSizeMod > offset)
-                nTxSizeMod -= offset;
+        if (!inBlock.count(parent)) {
+            return true;
         }
-        return nTxSizeMod;
     }
+    return false;
+}
 
-    double getPriority()
-    {
-        // Priority is sum(valuein * age) / modified_txsize
-        return dPriority / effectiveSizeMod();
+void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
+{
+    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
+        // Only test txs not already in the block
+        if (inBlock.count(*iit)) {
+            testSet.erase(iit++);
+        }
+        else {
+            iit++;
+        }
     }
+}
 
-    CFeeRate getFeeRate()
-    {
-        return CFeeRate(nTxFee, effectiveSize());
+bool BlockAssembler::TestPackage(uint64_t packageSize, unsigned int packageSigOps)
+{
+    if (nBlockSize + packageSize >= nBlockMaxSize)
+        return false;
+    if (nBlockSigOps + packageSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+    return true;
+}
+
+bool BlockAssembler::TestPackageFinality(const CTxMemPool::setEntries& package)
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, package) {
+        if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+            return false;
     }
+    return true;
+}
 
-    unsigned int GetLegacySigOpCount()
-    {
-        assert(pmapInfoById);
+bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
+{
+    if (nBlockSize + iter->GetTxSize() >= nBlockMaxSize) {
+        // If the block is so close to full that no more txs will fit
+        // or if we've tried more than 50 times to fill remaining space
+        // then flag that the block is finished
+        if (nBlockSize > nBlockMaxSize - 100 || lastFewTxs > 50) {
+             blockFinished = true;
+             return false;
+        }
+        // Once we're within 1000 bytes of a full block, only look at 50 more txs
+        // to try to fill the remaining space.
+        if (nBlockSize > nBlockMaxSize - 1000) {
+            lastFewTxs++;
+        }
+        return false;
+    }
+
+    if (nBlockSigOps + iter->GetSigOpCount() >= MAX_BLOCK_SIGOPS) {
+        // If the block has room for no more sig ops then
+        // flag that the block is finished
+        if (nBlockSigOps > MAX_BLOCK_SIGOPS - 2) {
+            blockFinished = true;
+            return false;
+        }
+        // Otherwise attempt to find another tx with fewer sigops
+        // to put in the block.
+        return false;
+    }
+
+    // Must check that lock times are still valid
+    // This can be removed once MTP is always enforced
+    // as long as reorgs keep the mempool consistent.
+    if (!IsFinalTx(iter->GetTx(), nHeight, nLockTimeCutoff))
+        return false;
 
-        unsigned int n = ::GetLegacySigOpCount(*ptx);
-        BOOST_FOREACH(const uint256& dephash, setDependsOn)
-        {
-            CTxInfo& depinfo = (*pmapInfoById)[dephash];
-            n += depinfo.GetLegacySigOpCount();
+    return true;
+}
+
+void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
+{
+    pblock->vtx.push_back(iter->GetTx());
+    pblocktemplate->vTxFees.push_back(iter->GetFee());
+    pblocktemplate->vTxSigOps.push_back(iter->GetSigOpCount());
+    nBlockSize += iter->GetTxSize();
+    ++nBlockTx;
+    nBlockSigOps += iter->GetSigOpCount();
+    nFees += iter->GetFee();
+    inBlock.insert(iter);
+
+    if (fPrintPriority) {
+        double dPriority = iter->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriority, dummy);
+        LogPrintf("priority %.1f fee %s txid %s\n",
+                  dPriority,
+                  CFeeRate(iter->GetModifiedFee(), iter->GetTxSize()).ToString(),
+                  iter->GetTx().GetHash().ToString());
+    }
+}
+
+void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
+        indexed_modified_transaction_set &mapModifiedTx)
+{
+    BOOST_FOREACH(const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        // Insert all descendants (not yet in block) into the modified set
+        BOOST_FOREACH(CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                modEntry.nSigOpCountWithAncestors -= it->GetSigOpCount();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
         }
-        return n;
     }
+}
+
+// Skip entries in mapTx that are already in a block or are present
+// in mapModifiedTx (which implies that the mapTx ancestor state is
+// stale due to ancestor inclusion in the block)
+// Also skip transactions that we've already failed to add. This can happen if
+// we consider a transaction in mapModifiedTx and it fails: we can then
+// potentially consider it again while walking mapTx.  It's currently
+// guaranteed to fail again, but as a belt-and-suspenders check we put it in
+// failedTx and avoid re-evaluation, since the re-evaluation would be using
+// cached size/sigops/fee values that are not actually correct.
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
+{
+    assert(it != mempool.mapTx.end());
+    if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it))
+        return true;
+    return false;
+}
 
-    bool DoInputs(CCoinsViewCache& view, const int nHeight, std::vector<CTxInfo*>& vAdded, unsigned int& nSigOpCounter)
+// This transaction selection algorithm orders the mempool based
+// on feerate of a transaction including all unconfirmed ancestors.
+// Since we don't remove transactions from the mempool as we select them
+// for block inclusion, we need an alternate method of updating the feerate
+// of a transaction with its not-yet-selected ancestors as we go.
+// This is accomplished by walking the in-mempool descendants of selected
+// transactions and storing a temporary modified state in mapModifiedTx.
+// Each time through the loop, we compare the best transaction in
+// mapModifiedTx with the next transaction in the mempool to decide what
+// transaction package to work on next.
+void BlockAssembler::addPackageTxs()
+{
+    // mapModifiedTx will store sorted packages after they are modified
+    // because some of their txs are already in the block
+    indexed_modified_transaction_set mapModifiedTx;
+    // Keep track of entries that failed inclusion, to avoid duplicate work
+    CTxMemPool::setEntries failedTx;
+
+    // Start by adding all descendants of previously added txs to mapModifiedTx
+    // and modifying them for their already included ancestors
+    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
     {
-        const CTransaction& tx = *ptx;
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
+                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+            ++mi;
+            continue;
+        }
 
-        if (view.HaveCoins(hash))
-            // Already included in block template
-            return true;
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
+        } else {
+            // Try to compare the mapTx entry to the mapModifiedTx entry
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                    CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx.
+                // Switch which transaction (package) to consider
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                // Increment mi for the next loop iteration.
+                ++mi;
+            }
+        }
 
-        assert(pmapInfoById);
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t packageSize = iter->GetSizeWithAncestors();
+        CAmount packageFees = iter->GetModFeesWithAncestors();
+        unsigned int packageSigOps = iter->GetSigOpCountWithAncestors();
+        if (fUsingModified) {
+            packageSize = modit->nSizeWithAncestors;
+            packageFees = modit->nModFeesWithAncestors;
+            packageSigOps = modit->nSigOpCountWithAncestors;
+        }
 
-        BOOST_FOREACH(const uint256& dephash, setDependsOn)
-        {
-            CTxInfo& depinfo = (*pmapInfoById)[dephash];
-            if (!depinfo.DoInputs(view, nHeight, vAdded, nSigOpCounter))
-                return false;
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize) && nBlockSize >= nBlockMinSize) {
+            // Everything else we might consider has a lower fee rate
+            return;
         }
 
-        if (!view.HaveInputs(tx))
-            return false;
+        if (!TestPackage(packageSize, packageSigOps)) {
+            if (fUsingModified) {
+                // Since we always look at the best entry in mapModifiedTx,
+                // we must erase failed entries so that we can consider the
+                // next best entry on the next loop iteration
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
 
-        nTxSigOpsP2SHOnly = GetP2SHSigOpCount(tx, view);
-        nSigOpCounter += nTxSigOpsP2SHOnly;
+        CTxMemPool::setEntries ancestors;
+        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
 
-        // Note that flags: we don't want to set mempool/IsStandard()
-        // policy here, but we still have to ensure that the block we
-        // create only contains transactions that are valid in new blocks.
-        CValidationState state;
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-            return false;
+        onlyUnconfirmed(ancestors);
+        ancestors.insert(iter);
 
-        UpdateCoins(tx, state, view, nHeight);
+        // Test if all tx's are Final
+        if (!TestPackageFinality(ancestors)) {
+            if (fUsingModified) {
+                mapModifiedTx.get<ancestor_score>().erase(modit);
+                failedTx.insert(iter);
+            }
+            continue;
+        }
 
-        vAdded.push_back(this);
+        // Package can be added. Sort the entries in a valid order.
+        std::vector<CTxMemPool::txiter> sortedEntries(ancestors.begin(), ancestors.end());
+        std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
 
-        return true;
-    }
-};
+        for (size_t i = 0; i < sortedEntries.size(); ++i) {
+            AddToBlock(sortedEntries[i]);
+            // Erase from the modified set, if present
+            mapModifiedTx.erase(sortedEntries[i]);
+        }
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+        // Update transactions that depend on each of these
+        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+    }
+}
 
-// We want to sort transactions by priority and fee, so:
-typedef CTxInfo* TxPriority;
-class TxPriorityCompare
+void BlockAssembler::addPriorityTxs()
 {
-    bool byFee;
+    if (nBlockPrioritySize == 0)
+        return;
 
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    // This vector will be sorted into a priority queue:
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    double actualPriority = -1;
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+         mi != mempool.mapTx.end(); ++mi)
     {
-        if (byFee)
-        {
-            if (a->getFeeRate() == b->getFeeRate())
-                return a->getPriority() < b->getPriority();
-            return a->getFeeRate() < b->getFeeRate();
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+    std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+
+    CTxMemPool::txiter iter;
+    while (!vecPriority.empty() && !blockFinished) { // add a tx from priority queue to fill the blockprioritysize
+        iter = vecPriority.front().second;
+        actualPriority = vecPriority.front().first;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+        vecPriority.pop_back();
+
+        // If tx already in block, skip
+        if (inBlock.count(iter)) {
+            assert(false); // shouldn't happen for priority txs
+            continue;
         }
-        else
-        {
-            if (a->getPriority() == b->getPriority())
-                return a->getFeeRate() < b->getFeeRate();
-            return a->getPriority() < b->getPriority();
+
+        // If tx is dependent on other mempool txs which haven't yet been included
+        // then put it in the waitSet
+        if (isStillDependent(iter)) {
+            waitPriMap.insert(std::make_pair(iter, actualPriority));
+            continue;
+        }
+
+        // If this tx fits in the block add it, otherwise keep looping
+        if (TestForBlock(iter)) {
+            AddToBlock(iter);
+
+            // If now that this txs is added we've surpassed our desired priority size
+            // or have dropped below the AllowFreeThreshold, then we're done adding priority txs
+            if (nBlockSize >= nBlockPrioritySize || !AllowFree(actualPriority)) {
+                break;
+            }
+
+            // This tx was successfully added, so
+            // add transactions that depend on this one to the priority queue to try again
+            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(iter))
+            {
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end()) {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
         }
     }
-};
+}
 
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
@@ -259,210 +626,24 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
-
     {
         LOCK2(cs_main, mempool.cs);
         CBlockIndex* pindexPrev = chainActive.Tip();
         const int nHeight = pindexPrev->nHeight + 1;
         pblock->nTime = GetAdjustedTime();
         const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        mapInfo_t mapInfoById;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-            const uint256& hash = tx.GetHash();
-            CTxInfo& txinfo = mapInfoById[hash];
-            txinfo.hash = hash;
-            txinfo.pmapInfoById = &mapInfoById;
-            txinfo.ptx = &tx;
-
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
-
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff))
-            {
-                txinfo.fInvalid = true;
-                continue;
-            }
-
-            double& dPriority = txinfo.dPriority;
-            CAmount& nTxFee = txinfo.nTxFee;
-            CAmount nTotalIn = 0;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CAmount nValueIn;
-                int nConf;
-                if (view.HaveCoins(txin.prevout.hash))
-                {
-                    const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                    assert(coins);
-                    // Input is confirmed
-                    nConf = nHeight - coins->nHeight;
-                    nValueIn = coins->vout[txin.prevout.n].nValue;
-                    dPriority += (double)nValueIn * nConf;
-                }
-                else
-                if (mempool.mapTx.count(txin.prevout.hash))
-                {
-                    // Input is still unconfirmed
-                    const uint256& hashPrev = txin.prevout.hash;
-                    nValueIn = mempool.mapTx[hashPrev].GetTx().vout[txin.prevout.n].nValue;
-                    txinfo.addDependsOn(hashPrev);
-                    mapInfoById[hashPrev].setDependents.insert(hash);
-                    nConf = 0;
-                }
-                else
-                {
-                    // We don't know where the input is
-                    // In this case, it's impossible to include this transaction in a block, so mark it invalid and move on
-                    txinfo.fInvalid = true;
-                    LogPrintf("priority %s invalid input %s\n", txinfo.hash.ToString().substr(0,10).c_str(), txin.prevout.hash.ToString().substr(0,10).c_str());
-                    goto nexttxn;
-                }
-
-                nTotalIn += nValueIn;
-            }
-
-            nTxFee = nTotalIn - tx.GetValueOut();
-
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            vecPriority.push_back(&txinfo);
-
-nexttxn:    (void)1;
-        }
-
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            CTxInfo& txinfo = *(vecPriority.front());
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            if (txinfo.fInvalid)
-                continue;
-
-            const CTransaction& tx = *txinfo.ptx;
-            double dPriority = txinfo.getPriority();
-            CFeeRate feeRate = txinfo.getFeeRate();
-
-            // Size limits
-            unsigned int nTxSize = txinfo.effectiveSize();
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = txinfo.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // second layer cached modifications just for this transaction
-            CCoinsViewCache viewTemp(&view);
-
-            std::vector<CTxInfo*> vAdded;
-            if (!txinfo.DoInputs(viewTemp, nHeight, vAdded, nTxSigOps))
-                continue;
-
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // push changes from the second layer cache to the first one
-            viewTemp.Flush();
-
-            // Added
-            nBlockSize += nTxSize;
-            nBlockTx += vAdded.size();
-            nBlockSigOps += nTxSigOps;
-
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            bool fResort = false;
-            BOOST_FOREACH(CTxInfo* ptxinfo, vAdded)
-            {
-                pblock->vtx.push_back(*ptxinfo->ptx);
-                pblocktemplate->vTxFees.push_back(ptxinfo->nTxFee);
-                pblocktemplate->vTxSigOps.push_back(GetLegacySigOpCount(*ptxinfo->ptx) + ptxinfo->nTxSigOpsP2SHOnly);
-                nFees += ptxinfo->nTxFee;
-
-                ptxinfo->fInvalid = true;
-                if (!ptxinfo->setDependents.empty())
-                {
-                    fResort = true;
-                    BOOST_FOREACH(const uint256& dhash, ptxinfo->setDependents)
-                    {
-                        CTxInfo& dtxinfo = mapInfoById[dhash];
-                        dtxinfo.rmDependsOn(ptxinfo->hash);
-                    }
-                }
-            }
-            if (fResort)
-                // Re-sort the priority queue to pick up on improved standing
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-        }
-
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? nMedianTimePast
+                                : pblock->GetBlockTime();
+
+        // Collect memory pool transactions into the block
+        BlockAssembler assembler(pblocktemplate.get(), nHeight, nLockTimeCutoff);
+        assembler.AddTransactions();
+        CAmount nFees = assembler.GetFees();
+
+        nLastBlockTx = assembler.GetBlockTx();
+        nLastBlockSize = assembler.GetBlockSize();
+        LogPrintf("CreateNewBlock(): total size %u txs: %u fees: %ld\n", nLastBlockSize, nLastBlockTx, nFees);
 
         // Compute final coinbase transaction.
         txNew.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
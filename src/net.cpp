@@ -23,6 +23,11 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define USE_EPOLL 1
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -77,6 +82,10 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+//! epoll instance watching the listen sockets and all node sockets; -1 means use select()
+static int hEpoll = -1;
+#endif
 CAddrMan addrman;
 int nMaxConnections = 125;
 int nWhiteConnections = 0;
@@ -103,11 +112,49 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 boost::condition_variable messageHandlerCondition;
+static int nMessageHandlerThreads = 1;
 
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
 
+/** Whether ThreadSocketHandler can wait on s: select() only handles descriptors below FD_SETSIZE. */
+static bool IsWatchableSocket(SOCKET s)
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        return true;
+#endif
+    return IsSelectableSocket(s);
+}
+
+#ifdef USE_EPOLL
+/** Start watching a new node's socket. Edge-triggered: readiness is latched in the node's flags. */
+static void RegisterSocketEvents(CNode* pnode)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR)
+        LogPrintf("epoll_ctl add failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+}
+
+/**
+ * Stop watching a node's socket; must happen before it is closed. Closing
+ * alone does not drop the registration while a forked child (-blocknotify)
+ * still holds a copy of the descriptor.
+ */
+static void UnregisterSocketEvents(CNode* pnode)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event; // ignored, but must be non-NULL on old kernels
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, pnode->hSocket, &event);
+}
+#endif
+
 void AddOneShot(string strDest)
 {
     LOCK(cs_vOneShots);
@@ -386,7 +433,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsWatchableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -421,6 +468,9 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+#ifdef USE_EPOLL
+        UnregisterSocketEvents(this);
+#endif
         CloseSocket(hSocket);
     }
 
@@ -667,7 +717,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            messageHandlerCondition.notify_all();
         }
     }
 
@@ -773,6 +823,208 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+/**
+ * Decide whether ThreadSocketHandler should send to or receive from pnode.
+ *
+ * Implement the following logic:
+ * * If there is data to send, wait for the socket to become writable. As this
+ *   only happens when optimistic write failed, we choose to first drain the
+ *   write buffer in this case before receiving more. This avoids needlessly
+ *   queueing received data, if the remote peer is not themselves receiving
+ *   data. This means properly utilizing TCP flow control signalling.
+ * * Otherwise, if there is no (complete) message in the receive buffer,
+ *   or there is space left in the buffer, wait for data to receive.
+ * * (if neither of the above applies, there is certainly one message
+ *   in the receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * * We send some data.
+ * * We wait for data to be received (and disconnect after timeout).
+ * * We process a message in the buffer (message handler thread).
+ */
+static void GetSocketInterest(CNode* pnode, bool& fWantRecv, bool& fWantSend)
+{
+    fWantRecv = false;
+    fWantSend = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fWantSend = true;
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
+/** Wait up to 50ms with select() and set the readiness flags of every node from the result. */
+static void SocketEventsSelect(std::set<SOCKET>& setListenReady)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!IsSelectableSocket(pnode->hSocket)) {
+                // Only possible if epoll became unavailable after more
+                // connections than select() can handle were allowed.
+                pnode->fDisconnect = true;
+                continue;
+            }
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            bool fWantRecv, fWantSend;
+            GetSocketInterest(pnode, fWantRecv, fWantSend);
+            if (fWantSend)
+                FD_SET(pnode->hSocket, &fdsetSend);
+            else if (fWantRecv)
+                FD_SET(pnode->hSocket, &fdsetRecv);
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec/1000);
+    }
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        if (FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            setListenReady.insert(hListenSocket.socket);
+
+    // vNodes may have changed while waiting; nodes added since then were not
+    // part of the select() and must not be tested against the fd_sets.
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        SOCKET hSocket = pnode->hSocket;
+        if (hSocket == INVALID_SOCKET || !IsSelectableSocket(hSocket)) {
+            pnode->fRecvReady = pnode->fSendReady = false;
+            continue;
+        }
+        pnode->fRecvReady = FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError);
+        pnode->fSendReady = FD_ISSET(hSocket, &fdsetSend);
+    }
+}
+
+#ifdef USE_EPOLL
+/**
+ * Wait up to 50ms for socket events with epoll and latch them into the
+ * nodes' readiness flags. Only nodes with an event, or a flag still set from
+ * an earlier pass, are looked at, so idle connections cost no syscalls.
+ */
+static void SocketEventsEpoll(std::set<SOCKET>& setListenReady)
+{
+    // Don't sleep while some socket is already known to have work pending.
+    int nTimeout = 50;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (nTimeout && (pnode->fRecvReady || pnode->fSendReady)) {
+                bool fWantRecv, fWantSend;
+                GetSocketInterest(pnode, fWantRecv, fWantSend);
+                if ((pnode->fRecvReady && fWantRecv) || (pnode->fSendReady && fWantSend))
+                    nTimeout = 0;
+            }
+        }
+    }
+
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hEpoll, events, ARRAYLEN(events), nTimeout);
+    if (nEvents == SOCKET_ERROR) {
+        if (errno != EINTR)
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+        return;
+    }
+
+    // Event pointers stay valid here: nodes are only deleted by this thread,
+    // and only after UnregisterSocketEvents() ran for them.
+    for (int i = 0; i < nEvents; i++)
+    {
+        const struct epoll_event& event = events[i];
+        bool fListen = false;
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            if (event.data.ptr == &hListenSocket) {
+                setListenReady.insert(hListenSocket.socket);
+                fListen = true;
+            }
+        }
+        if (fListen)
+            continue;
+        CNode* pnode = (CNode*)event.data.ptr;
+        if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            pnode->fRecvReady = true;
+        if (event.events & EPOLLOUT)
+            pnode->fSendReady = true;
+    }
+}
+
+/** Set up the epoll instance and register the listen sockets. Falls back to select() on failure. */
+static void InitSocketEvents()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == SOCKET_ERROR) {
+        LogPrintf("epoll_create1 failed (%s), falling back to select()\n", NetworkErrorString(errno));
+        return;
+    }
+    BOOST_FOREACH(ListenSocket& hListenSocket, vhListenSocket) {
+        // Level-triggered: at most one connection is accepted per socket and pass.
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) == SOCKET_ERROR) {
+            LogPrintf("epoll_ctl failed (%s), falling back to select()\n", NetworkErrorString(errno));
+            close(hEpoll);
+            hEpoll = -1;
+            return;
+        }
+    }
+    LogPrintf("Using epoll for socket events\n");
+}
+#endif
+
 static list<CNode*> vNodesDisconnected;
 
 void ThreadSocketHandler()
@@ -846,91 +1098,21 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        std::set<SOCKET> setListenReady;
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            SocketEventsEpoll(setListenReady);
+        else
+#endif
+            SocketEventsSelect(setListenReady);
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && setListenReady.count(hListenSocket.socket))
             {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
@@ -957,7 +1139,7 @@ void ThreadSocketHandler()
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
                 }
-                else if (!IsSelectableSocket(hSocket))
+                else if (!IsWatchableSocket(hSocket))
                 {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
@@ -1021,7 +1203,10 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            bool fWantRecv = false, fWantSend = false;
+            if (pnode->fRecvReady || pnode->fSendReady)
+                GetSocketInterest(pnode, fWantRecv, fWantSend);
+            if (pnode->fRecvReady && fWantRecv)
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1037,6 +1222,9 @@ void ThreadSocketHandler()
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
                             pnode->RecordBytesRecv(nBytes);
+                            // A short read drained the socket; new data raises a new edge.
+                            if ((size_t)nBytes < sizeof(pchBuf))
+                                pnode->fRecvReady = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -1049,6 +1237,8 @@ void ThreadSocketHandler()
                         {
                             // error
                             int nErr = WSAGetLastError();
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fRecvReady = false;
                             if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
@@ -1065,11 +1255,16 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady && fWantSend)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
                     SocketSendData(pnode);
+                    // A partial send means the kernel buffer is full; the
+                    // socket becomes ready again once it drains.
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSendReady = false;
+                }
             }
 
             //
@@ -1524,7 +1719,13 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Message handler worker nWorker of nMessageHandlerThreads. Peers are sharded
+ * across the workers by node id, so all messages of one peer are handled by
+ * the same thread and in order, while a peer that is slow to process does not
+ * hold up the peers of other workers.
+ */
+void ThreadMessageHandler(int nWorker)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1533,19 +1734,21 @@ void ThreadMessageHandler()
     while (true)
     {
         vector<CNode*> vNodesCopy;
+        // The trickle node is picked among all peers, so that each peer is
+        // chosen as often as with a single handler thread.
+        NodeId idTrickle = -1;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            if (!vNodes.empty())
+                idTrickle = vNodes[GetRand(vNodes.size())]->GetId();
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (pnode->GetId() % nMessageHandlerThreads != nWorker)
+                    continue;
+                vNodesCopy.push_back(pnode);
                 pnode->AddRef();
             }
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
@@ -1576,7 +1779,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(pnode, pnode->GetId() == idTrickle || pnode->fWhitelisted);
             }
             boost::this_thread::interruption_point();
         }
@@ -1800,6 +2003,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        InitSocketEvents();
+#endif
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1809,7 +2016,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    nMessageHandlerThreads = std::max(1, std::min((int)GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS), MAX_MSGHAND_THREADS));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -1847,6 +2057,12 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef USE_EPOLL
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -2112,6 +2328,8 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
+    fRecvReady = false;
+    fSendReady = false;
     nPingUsecTime = 0;
     fPingQueued = false;
 
@@ -2120,6 +2338,10 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
         id = nLastNodeId++;
     }
 
+#ifdef USE_EPOLL
+    RegisterSocketEvents(this);
+#endif
+
     if (fLogIPs)
         LogPrint("net", "Added connection to %s peer=%d\n", addrName, id);
     else
@@ -4,19 +4,211 @@
 
 #include "pubkey.h"
 
-#include "eccryptoverify.h"
+#include <secp256k1.h>
 
-#include "ecwrapper.h"
+namespace
+{
+/* Global secp256k1_context object used for verification. */
+secp256k1_context_t* secp256k1_context_verify = NULL;
+}
+
+/** This function is taken from the libsecp256k1 distribution and implements
+ *  DER parsing for ECDSA signatures, while supporting an arbitrary subset of
+ *  format violations.
+ *
+ *  Supported violations include negative integers, excessive padding, garbage
+ *  at the end, and overly long length descriptors. This is safe to use in
+ *  Bitcoin because since the activation of BIP66, signatures are verified to be
+ *  strict DER before being passed to this module, and we know it supports all
+ *  violations present in the blockchain before that point.
+ *
+ *  On success, r and s are set to the 32-byte big-endian encodings of the
+ *  signature's R and S values. Values that overflow the group order are
+ *  replaced by zero, which can never verify, exactly like OpenSSL's range
+ *  check after its d2i/i2d normalization round-trip.
+ */
+static bool ecdsa_signature_parse_der_lax(const unsigned char *input, size_t inputlen, unsigned char r[32], unsigned char s[32]) {
+    static const unsigned char order[32] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE,
+        0xBA, 0xAE, 0xDC, 0xE6, 0xAF, 0x48, 0xA0, 0x3B,
+        0xBF, 0xD2, 0x5E, 0x8C, 0xD0, 0x36, 0x41, 0x41
+    };
+    size_t rpos, rlen, spos, slen;
+    size_t pos = 0;
+    size_t lenbyte;
+    bool overflow = false;
+
+    memset(r, 0, 32);
+    memset(s, 0, 32);
+
+    /* Sequence tag byte */
+    if (pos == inputlen || input[pos] != 0x30) {
+        return false;
+    }
+    pos++;
+
+    /* Sequence length bytes */
+    if (pos == inputlen) {
+        return false;
+    }
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (pos + lenbyte > inputlen) {
+            return false;
+        }
+        pos += lenbyte;
+    }
+
+    /* Integer tag byte for R */
+    if (pos == inputlen || input[pos] != 0x02) {
+        return false;
+    }
+    pos++;
+
+    /* Integer length for R */
+    if (pos == inputlen) {
+        return false;
+    }
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (pos + lenbyte > inputlen) {
+            return false;
+        }
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t)) {
+            return false;
+        }
+        rlen = 0;
+        while (lenbyte > 0) {
+            rlen = (rlen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        rlen = lenbyte;
+    }
+    if (rlen > inputlen - pos) {
+        return false;
+    }
+    rpos = pos;
+    pos += rlen;
+
+    /* Integer tag byte for S */
+    if (pos == inputlen || input[pos] != 0x02) {
+        return false;
+    }
+    pos++;
+
+    /* Integer length for S */
+    if (pos == inputlen) {
+        return false;
+    }
+    lenbyte = input[pos++];
+    if (lenbyte & 0x80) {
+        lenbyte -= 0x80;
+        if (pos + lenbyte > inputlen) {
+            return false;
+        }
+        while (lenbyte > 0 && input[pos] == 0) {
+            pos++;
+            lenbyte--;
+        }
+        if (lenbyte >= sizeof(size_t)) {
+            return false;
+        }
+        slen = 0;
+        while (lenbyte > 0) {
+            slen = (slen << 8) + input[pos];
+            pos++;
+            lenbyte--;
+        }
+    } else {
+        slen = lenbyte;
+    }
+    if (slen > inputlen - pos) {
+        return false;
+    }
+    spos = pos;
+
+    /* Ignore leading zeroes in R */
+    while (rlen > 0 && input[rpos] == 0) {
+        rlen--;
+        rpos++;
+    }
+    /* Copy R value */
+    if (rlen > 32) {
+        overflow = true;
+    } else {
+        memcpy(r + 32 - rlen, input + rpos, rlen);
+    }
+
+    /* Ignore leading zeroes in S */
+    while (slen > 0 && input[spos] == 0) {
+        slen--;
+        spos++;
+    }
+    /* Copy S value */
+    if (slen > 32) {
+        overflow = true;
+    } else {
+        memcpy(s + 32 - slen, input + spos, slen);
+    }
+
+    if (!overflow) {
+        overflow = memcmp(r, order, 32) >= 0 || memcmp(s, order, 32) >= 0;
+    }
+    if (overflow) {
+        /* Overwrite the result again with a correctly-parsed but invalid
+           signature if parsing failed. */
+        memset(r, 0, 32);
+        memset(s, 0, 32);
+    }
+    return true;
+}
+
+/** Serialize a 32-byte big-endian integer as a minimal DER INTEGER. */
+static size_t ecdsa_signature_serialize_der_int(unsigned char *output, const unsigned char in[32]) {
+    size_t skip = 0;
+    while (skip < 31 && in[skip] == 0 && in[skip + 1] < 0x80) {
+        skip++;
+    }
+    size_t len = 32 - skip;
+    bool pad = in[skip] >= 0x80;
+    output[0] = 0x02;
+    output[1] = len + pad;
+    output[2] = 0;
+    memcpy(output + 2 + pad, in + skip, len);
+    return 2 + pad + len;
+}
+
+/** Re-encode a (R, S) pair as a strict DER signature, which is the only form
+ *  secp256k1_ecdsa_verify accepts. The output buffer must hold 72 bytes. */
+static size_t ecdsa_signature_serialize_der(unsigned char *output, const unsigned char r[32], const unsigned char s[32]) {
+    size_t len = 2;
+    len += ecdsa_signature_serialize_der_int(output + len, r);
+    len += ecdsa_signature_serialize_der_int(output + len, s);
+    output[0] = 0x30;
+    output[1] = len - 2;
+    return len;
+}
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
+    if (vchSig.empty())
         return false;
-    if (!key.Verify(hash, vchSig))
+    unsigned char r[32], s[32];
+    if (!ecdsa_signature_parse_der_lax(&vchSig[0], vchSig.size(), r, s))
         return false;
-    return true;
+    unsigned char der[72];
+    size_t derlen = ecdsa_signature_serialize_der(der, r, s);
+    return secp256k1_ecdsa_verify(secp256k1_context_verify, hash.begin(), der, derlen, begin(), size()) == 1;
 }
 
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
@@ -24,33 +216,29 @@ bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned cha
         return false;
     int recid = (vchSig[0] - 27) & 3;
     bool fComp = ((vchSig[0] - 27) & 4) != 0;
-    CECKey key;
-    if (!key.Recover(hash, &vchSig[1], recid))
+    unsigned char pubkey[65];
+    int pubkeylen = 65;
+    if (!secp256k1_ecdsa_recover_compact(secp256k1_context_verify, hash.begin(), &vchSig[1], pubkey, &pubkeylen, fComp, recid))
         return false;
-    std::vector<unsigned char> pubkey;
-    key.GetPubKey(pubkey, fComp);
-    Set(pubkey.begin(), pubkey.end());
+    Set(pubkey, pubkey + pubkeylen);
     return true;
 }
 
 bool CPubKey::IsFullyValid() const {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
-        return false;
-    return true;
+    return secp256k1_ec_pubkey_verify(secp256k1_context_verify, begin(), size()) == 1;
 }
 
 bool CPubKey::Decompress() {
     if (!IsValid())
         return false;
-    CECKey key;
-    if (!key.SetPubKey(begin(), size()))
+    unsigned char pubkey[65];
+    int pubkeylen = size();
+    memcpy(pubkey, begin(), pubkeylen);
+    if (!secp256k1_ec_pubkey_decompress(secp256k1_context_verify, pubkey, &pubkeylen))
         return false;
-    std::vector<unsigned char> pubkey;
-    key.GetPubKey(pubkey, false);
-    Set(pubkey.begin(), pubkey.end());
+    Set(pubkey, pubkey + pubkeylen);
     return true;
 }
 
@@ -61,13 +249,12 @@ bool CPubKey::Derive(CPubKey& pubkeyChild, ChainCode &ccChild, unsigned int nChi
     unsigned char out[64];
     BIP32Hash(cc, nChild, *begin(), begin()+1, out);
     memcpy(ccChild.begin(), out+32, 32);
-    CECKey key;
-    bool ret = key.SetPubKey(begin(), size());
-    ret &= key.TweakPublic(out);
-    std::vector<unsigned char> pubkey;
-    key.GetPubKey(pubkey, true);
-    pubkeyChild.Set(pubkey.begin(), pubkey.end());
-    return ret;
+    unsigned char pubkey[33];
+    memcpy(pubkey, begin(), 33);
+    if (!secp256k1_ec_pubkey_tweak_add(secp256k1_context_verify, pubkey, 33, out))
+        return false;
+    pubkeyChild.Set(pubkey, pubkey + 33);
+    return true;
 }
 
 void CExtPubKey::Encode(unsigned char code[74]) const {
@@ -95,3 +282,25 @@ bool CExtPubKey::Derive(CExtPubKey &out, unsigned int nChild) const {
     out.nChild = nChild;
     return pubkey.Derive(out.pubkey, out.chaincode, nChild, chaincode);
 }
+
+/* static */ int ECCVerifyHandle::refcount = 0;
+
+ECCVerifyHandle::ECCVerifyHandle()
+{
+    if (refcount == 0) {
+        assert(secp256k1_context_verify == NULL);
+        secp256k1_context_verify = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+        assert(secp256k1_context_verify != NULL);
+    }
+    refcount++;
+}
+
+ECCVerifyHandle::~ECCVerifyHandle()
+{
+    refcount--;
+    if (refcount == 0) {
+        assert(secp256k1_context_verify != NULL);
+        secp256k1_context_destroy(secp256k1_context_verify);
+        secp256k1_context_verify = NULL;
+    }
+}
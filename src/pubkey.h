@@ -174,6 +174,8 @@ public:
     /**
      * Verify a DER signature (~72 bytes).
      * If this public key is not fully valid, the return value will be false.
+     * Signatures are parsed with the same DER leniency OpenSSL had, so this
+     * is safe to use on pre-BIP66 signatures.
      */
     bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
 
@@ -205,4 +207,15 @@ struct CExtPubKey {
     bool Derive(CExtPubKey& out, unsigned int nChild) const;
 };
 
+/** Users of this module must hold an ECCVerifyHandle. The constructor and
+ *  destructor of these are not allowed to run in parallel, though. */
+class ECCVerifyHandle
+{
+    static int refcount;
+
+public:
+    ECCVerifyHandle();
+    ~ECCVerifyHandle();
+};
+
 #endif // BITCOIN_PUBKEY_H
@@ -1000,6 +1000,53 @@ bool EvalScript(std::vector<valtype>& stack, const CScript& script, unsigned int
 
 namespace {
 
+/** Serialize a scriptCode for signature hashing, skipping OP_CODESEPARATORs */
+template<typename S>
+void SerializeScriptCode(S &s, const CScript& scriptCode) {
+    CScript::const_iterator it = scriptCode.begin();
+    CScript::const_iterator itBegin = it;
+    opcodetype opcode;
+    unsigned int nCodeSeparators = 0;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR)
+            nCodeSeparators++;
+    }
+    ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
+    it = itBegin;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR) {
+            s.write((char*)&itBegin[0], it-itBegin-1);
+            itBegin = it;
+        }
+    }
+    if (itBegin != scriptCode.end())
+        s.write((char*)&itBegin[0], it-itBegin);
+}
+
+/** Stream that appends to a byte vector, for building PrecomputedTransactionData::vchTail */
+class CVectorAppender
+{
+private:
+    std::vector<unsigned char>& vch;
+
+public:
+    int nType;
+    int nVersion;
+
+    CVectorAppender(int nTypeIn, int nVersionIn, std::vector<unsigned char>& vchIn) : vch(vchIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CVectorAppender& write(const char *pch, size_t size) {
+        vch.insert(vch.end(), (const unsigned char*)pch, (const unsigned char*)pch + size);
+        return (*this);
+    }
+
+    template<typename T>
+    CVectorAppender& operator<<(const T& obj) {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /**
  * Wrapper that serializes like CTransaction, but with the modifications
  *  required for the signature hash done in-place
@@ -1023,24 +1070,7 @@ public:
     /** Serialize the passed scriptCode, skipping OP_CODESEPARATORs */
     template<typename S>
     void SerializeScriptCode(S &s, int nType, int nVersion) const {
-        CScript::const_iterator it = scriptCode.begin();
-        CScript::const_iterator itBegin = it;
-        opcodetype opcode;
-        unsigned int nCodeSeparators = 0;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR)
-                nCodeSeparators++;
-        }
-        ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
-        it = itBegin;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR) {
-                s.write((char*)&itBegin[0], it-itBegin-1);
-                itBegin = it;
-            }
-        }
-        if (itBegin != scriptCode.end())
-            s.write((char*)&itBegin[0], it-itBegin);
+        ::SerializeScriptCode(s, scriptCode);
     }
 
     /** Serialize an input of txTo */
@@ -1097,7 +1127,25 @@ public:
 
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    ::WriteCompactSize(ss, txTo.vin.size());
+    vMidstates.reserve(txTo.vin.size());
+    vchTail.reserve(txTo.vin.size() * BLANK_INPUT_SIZE + ::GetSerializeSize(txTo.vout, SER_GETHASH, 0) + 4);
+    CVectorAppender tail(SER_GETHASH, 0, vchTail);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vMidstates.push_back(ss);
+        size_t nStart = vchTail.size();
+        tail << txTo.vin[i].prevout << CScript() << txTo.vin[i].nSequence;
+        assert(vchTail.size() - nStart == BLANK_INPUT_SIZE);
+        ss.write((const char*)&vchTail[nStart], BLANK_INPUT_SIZE);
+    }
+    tail << txTo.vout << txTo.nLockTime;
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1113,6 +1161,23 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    // Plain SIGHASH_ALL: continue from the precomputed prefix and finish
+    // with the precomputed tail. This produces exactly the bytes that
+    // CTransactionSignatureSerializer would.
+    if (txdata && (nHashType & 0x1f) != SIGHASH_NONE && (nHashType & 0x1f) != SIGHASH_SINGLE && !(nHashType & SIGHASH_ANYONECANPAY)) {
+        assert(txdata->vMidstates.size() == txTo.vin.size());
+        CHashWriter ss(txdata->vMidstates[nIn]);
+        const unsigned char* pInput = &txdata->vchTail[PrecomputedTransactionData::TailOffset(nIn)];
+        // prevout
+        ss.write((const char*)pInput, 36);
+        SerializeScriptCode(ss, scriptCode);
+        ss << txTo.vin[nIn].nSequence;
+        const unsigned char* pRest = pInput + PrecomputedTransactionData::BLANK_INPUT_SIZE;
+        ss.write((const char*)pRest, &txdata->vchTail[0] + txdata->vchTail.size() - pRest);
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
@@ -1140,7 +1205,12 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    if (!fHaveSighash || nHashType != nSighashType || scriptCode != sighashScriptCode) {
+        sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
+        nSighashType = nHashType;
+        sighashScriptCode = scriptCode;
+        fHaveSighash = true;
+    }
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -83,7 +84,32 @@ enum
     SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY = (1U << 9),
 };
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * The parts of a transaction's signature hash preimage that do not depend on
+ * the input being signed, computed once per transaction. For SIGHASH_ALL the
+ * preimage of input i is: a shared prefix (nVersion, the input count and
+ * inputs 0..i-1 with blanked scripts), input i with its scriptCode, and a
+ * shared tail (the remaining blanked inputs, all outputs and nLockTime).
+ * Keeping the hash state after each prefix and the serialized tail avoids
+ * reserializing the whole transaction for every input.
+ */
+class PrecomputedTransactionData
+{
+public:
+    //! Hash state after nVersion, the input count and the blanked inputs before each index
+    std::vector<CHashWriter> vMidstates;
+    //! Every input with a blanked script, followed by the outputs and nLockTime
+    std::vector<unsigned char> vchTail;
+
+    PrecomputedTransactionData(const CTransaction& tx);
+
+    //! Offset in vchTail of the serialized input nIn
+    static size_t TailOffset(unsigned int nIn) { return (size_t)nIn * BLANK_INPUT_SIZE; }
+    //! prevout (36 bytes), empty script (1 byte), nSequence (4 bytes)
+    static const size_t BLANK_INPUT_SIZE = 41;
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* txdata = NULL);
 
 class BaseSignatureChecker
 {
@@ -106,12 +132,19 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
+
+    //! Last computed signature hash; CHECKMULTISIG tries each signature against several keys
+    mutable bool fHaveSighash;
+    mutable int nSighashType;
+    mutable CScript sighashScriptCode;
+    mutable uint256 sighash;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn), fHaveSighash(false), nSighashType(0) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
 };
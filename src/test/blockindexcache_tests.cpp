@@ -0,0 +1,182 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+#include "txdb.h"
+
+#include "test/test_bitcoin.h"
+
+#include <deque>
+#include <map>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+/**
+ * Block index with a main chain and a fork on top of the genesis block, stored
+ * in the block tree database. Runs with the regtest parameters, so the headers
+ * are cheap to mine.
+ */
+struct BlockIndexCacheSetup : public TestingSetup {
+    std::deque<CBlockIndex> vIndex;
+    std::deque<uint256> vHash;
+    std::map<uint256, arith_uint256> mapChainWork;
+    std::map<uint256, uint256> mapSkip;
+
+    BlockIndexCacheSetup()
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        CBlockIndex* pindexGenesis = chainActive.Genesis();
+        CBlockIndex* pindexFork = NULL;
+        CBlockIndex* pindexPrev = pindexGenesis;
+        for (int i = 0; i < 150; i++) {
+            pindexPrev = AddHeader(pindexPrev);
+            if (pindexPrev->nHeight == 100)
+                pindexFork = pindexPrev;
+        }
+        pindexPrev = pindexFork;
+        for (int i = 0; i < 20; i++)
+            pindexPrev = AddHeader(pindexPrev);
+
+        std::vector<const CBlockIndex*> vBlocks;
+        BOOST_FOREACH(const CBlockIndex& index, vIndex)
+            vBlocks.push_back(&index);
+        BOOST_REQUIRE(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), 0, vBlocks));
+
+        // Without a cache, the derived fields are recomputed
+        ReloadBlockIndex();
+        BOOST_REQUIRE_EQUAL(mapBlockIndex.size(), vIndex.size() + 1);
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+            const CBlockIndex* pindex = item.second;
+            BOOST_CHECK(pindex->nChainWork == (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex));
+            BOOST_CHECK(pindex->pprev == NULL || pindex->pskip != NULL);
+            mapChainWork[item.first] = pindex->nChainWork;
+            mapSkip[item.first] = pindex->pskip ? pindex->pskip->GetBlockHash() : uint256();
+        }
+    }
+
+    ~BlockIndexCacheSetup()
+    {
+        SelectParams(CBaseChainParams::MAIN);
+    }
+
+    CBlockIndex* AddHeader(CBlockIndex* pindexPrev)
+    {
+        CBlockHeader header;
+        header.nVersion = 4;
+        header.hashPrevBlock = pindexPrev->GetBlockHash();
+        header.nTime = pindexPrev->nTime + 600;
+        header.nBits = UintToArith256(Params().GetConsensus().powLimit).GetCompact();
+        header.nNonce = 0;
+        while (!CheckProofOfWork(header.GetHash(), header.nBits, Params().GetConsensus()))
+            header.nNonce++;
+
+        vHash.push_back(header.GetHash());
+        vIndex.push_back(CBlockIndex(header));
+        CBlockIndex* pindex = &vIndex.back();
+        pindex->phashBlock = &vHash.back();
+        pindex->pprev = pindexPrev;
+        pindex->nHeight = pindexPrev->nHeight + 1;
+        pindex->nStatus = BLOCK_VALID_TREE;
+        return pindex;
+    }
+
+    void ReloadBlockIndex()
+    {
+        UnloadBlockIndex();
+        BOOST_REQUIRE(LoadBlockIndex());
+        BOOST_REQUIRE(InitBlockIndex());
+    }
+
+    //! Whether the loaded index matches the recomputed chain work and skip pointers
+    bool MatchesRecomputed() const
+    {
+        if (mapBlockIndex.size() != mapChainWork.size())
+            return false;
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+            std::map<uint256, arith_uint256>::const_iterator it = mapChainWork.find(item.first);
+            if (it == mapChainWork.end() || it->second != item.second->nChainWork)
+                return false;
+            const CBlockIndex* pskip = item.second->pskip;
+            if (mapSkip.find(item.first)->second != (pskip ? pskip->GetBlockHash() : uint256()))
+                return false;
+        }
+        return true;
+    }
+};
+}
+
+BOOST_FIXTURE_TEST_SUITE(blockindexcache_tests, BlockIndexCacheSetup)
+
+BOOST_AUTO_TEST_CASE(blockindexcache_roundtrip)
+{
+    BOOST_REQUIRE(WriteBlockIndexCache());
+    CBlockIndexCache cache;
+    BOOST_REQUIRE(pblocktree->ReadBlockIndexCache(cache));
+    BOOST_CHECK_EQUAL(cache.vHash.size(), mapBlockIndex.size());
+
+    ReloadBlockIndex();
+    BOOST_CHECK(MatchesRecomputed());
+    // The cache is only good for the one startup
+    BOOST_CHECK(!pblocktree->ReadBlockIndexCache(cache));
+
+    // A cache that describes the loaded entries is trusted as is, so a
+    // changed chain work shows that it was used rather than recomputed.
+    BOOST_REQUIRE(WriteBlockIndexCache());
+    BOOST_REQUIRE(pblocktree->ReadBlockIndexCache(cache));
+    cache.vChainWork.back() = ArithToUint256(arith_uint256(42));
+    BOOST_REQUIRE(pblocktree->WriteBlockIndexCache(cache));
+    ReloadBlockIndex();
+    BOOST_CHECK(mapBlockIndex[cache.vHash.back()]->nChainWork == arith_uint256(42));
+}
+
+BOOST_AUTO_TEST_CASE(blockindexcache_mismatch)
+{
+    BOOST_REQUIRE(WriteBlockIndexCache());
+    CBlockIndexCache cacheGood;
+    BOOST_REQUIRE(pblocktree->ReadBlockIndexCache(cacheGood));
+    // Mark the cache, so that using it rather than recomputing shows
+    cacheGood.vChainWork[1] = ArithToUint256(arith_uint256(42));
+    const uint32_t nLast = cacheGood.vHash.size() - 1;
+    // Find two entries of the same height, on the fork and on the main chain
+    uint32_t nSameHeight = 1;
+    while (mapBlockIndex[cacheGood.vHash[nSameHeight]]->nHeight != mapBlockIndex[cacheGood.vHash[nSameHeight - 1]]->nHeight)
+        nSameHeight++;
+
+    std::vector<CBlockIndexCache> vBad(7, cacheGood);
+    // An entry that is not in the block index
+    vBad[0].vHash.push_back(GetRandHash());
+    vBad[0].vChainWork.push_back(uint256());
+    vBad[0].vSkip.push_back(CBlockIndexCache::NO_SKIP);
+    // A missing entry
+    vBad[1].vHash.pop_back();
+    vBad[1].vChainWork.pop_back();
+    vBad[1].vSkip.pop_back();
+    // An unknown entry in place of a loaded one
+    vBad[2].vHash[nLast] = GetRandHash();
+    // Another format version
+    vBad[3].nVersion = CBlockIndexCache::CURRENT_VERSION + 1;
+    // Skip pointers to the entry itself, past the end, and to an entry of the same height
+    vBad[4].vSkip[nLast] = nLast;
+    vBad[5].vSkip[nLast] = nLast + 1;
+    vBad[6].vSkip[nSameHeight] = nSameHeight - 1;
+
+    for (unsigned int i = 0; i < vBad.size(); i++) {
+        BOOST_REQUIRE(pblocktree->WriteBlockIndexCache(vBad[i]));
+        ReloadBlockIndex();
+        BOOST_CHECK_MESSAGE(MatchesRecomputed(), "mismatched cache " << i << " was used");
+    }
+
+    // The marked cache itself is used
+    BOOST_REQUIRE(pblocktree->WriteBlockIndexCache(cacheGood));
+    ReloadBlockIndex();
+    BOOST_CHECK(!MatchesRecomputed());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
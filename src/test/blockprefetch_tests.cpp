@@ -0,0 +1,99 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockprefetch.h"
+#include "coins.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <set>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockprefetch_tests, BasicTestingSetup)
+
+namespace {
+//! Records which outpoints were looked up
+class CCoinsViewRecorder : public CCoinsView
+{
+public:
+    mutable boost::mutex mutex;
+    mutable std::set<COutPoint> setRequested;
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        setRequested.insert(outpoint);
+        return false;
+    }
+
+    size_t Count() const
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return setRequested.size();
+    }
+};
+}
+
+BOOST_AUTO_TEST_CASE(blockprefetch_inputs)
+{
+    CCoinsViewRecorder view;
+    CBlockPrefetcher prefetcher;
+    prefetcher.SetView(&view);
+    BOOST_CHECK(prefetcher.IsEnabled());
+
+    COutPoint prevoutA(GetRandHash(), 0), prevoutB(GetRandHash(), 1), prevoutC(GetRandHash(), 2);
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    CMutableTransaction spend1;
+    spend1.vin.resize(2);
+    spend1.vin[0].prevout = prevoutA;
+    spend1.vin[1].prevout = prevoutB;
+    spend1.vout.resize(1);
+    CMutableTransaction spend2;
+    spend2.vin.resize(1);
+    spend2.vin[0].prevout = COutPoint(CTransaction(spend1).GetHash(), 0);
+    spend2.vout.resize(1);
+
+    boost::shared_ptr<CBlock> pblock(new CBlock());
+    pblock->vtx.push_back(coinbase);
+    pblock->vtx.push_back(spend1);
+    pblock->vtx.push_back(spend2);
+
+    CMutableTransaction spend3;
+    spend3.vin.resize(1);
+    spend3.vin[0].prevout = prevoutC;
+    spend3.vout.resize(1);
+    boost::shared_ptr<CBlock> pblockOld(new CBlock());
+    pblockOld->vtx.push_back(coinbase);
+    pblockOld->vtx.push_back(spend3);
+
+    // Blocks at or below the connected height are not looked at
+    prefetcher.SetConnectedHeight(10);
+    prefetcher.Add(10, boost::shared_ptr<const CBlock>(pblockOld));
+    prefetcher.Add(11, boost::shared_ptr<const CBlock>(pblock));
+
+    boost::thread thread(boost::bind(&CBlockPrefetcher::Thread, &prefetcher));
+    for (int i = 0; i < 1000 && view.Count() < 2; i++)
+        MilliSleep(5);
+    thread.interrupt();
+    thread.join();
+
+    // Only the inputs that are not created within the block itself
+    BOOST_CHECK_EQUAL(view.Count(), 2U);
+    BOOST_CHECK(view.setRequested.count(prevoutA));
+    BOOST_CHECK(view.setRequested.count(prevoutB));
+
+    prefetcher.SetView(NULL);
+    BOOST_CHECK(!prefetcher.IsEnabled());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
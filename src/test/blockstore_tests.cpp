@@ -0,0 +1,70 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockstore.h"
+#include "chainparams.h"
+#include "main.h"
+#include "streams.h"
+
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockstore_tests, TestingSetup)
+
+static std::vector<unsigned char> Serialize(const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    return std::vector<unsigned char>(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(blockstore_read_write)
+{
+    const CMessageHeader::MessageStartChars& messageStart = Params().MessageStart();
+    CBlock block1 = Params().GenesisBlock();
+    CBlock block2 = block1;
+    block2.nTime++;
+    blockFileStore.Clear();
+
+    // Writing a block makes it available from the cache
+    CDiskBlockPos pos1(1, 0);
+    BOOST_CHECK(WriteBlockToDisk(block1, pos1, messageStart));
+    BOOST_CHECK_EQUAL(blockFileStore.GetCacheSize(), Serialize(block1).size());
+    std::vector<unsigned char> vch;
+    BOOST_CHECK(ReadRawBlockFromDisk(vch, pos1, messageStart));
+    BOOST_CHECK(vch == Serialize(block1));
+
+    // Read back through the file once the cache is gone
+    blockFileStore.Clear();
+    vch.clear();
+    BOOST_CHECK(ReadRawBlockFromDisk(vch, pos1, messageStart));
+    BOOST_CHECK(vch == Serialize(block1));
+    CBlock blockRead;
+    BOOST_CHECK(ReadBlockFromDisk(blockRead, pos1));
+    BOOST_CHECK(blockRead.GetHash() == block1.GetHash());
+
+    // A cache that holds one block drops the older one when another is added;
+    // both remain readable, the second after the file has grown.
+    blockFileStore.SetMaxCacheSize(Serialize(block1).size());
+    CDiskBlockPos pos2(1, pos1.nPos + Serialize(block1).size());
+    BOOST_CHECK(WriteBlockToDisk(block2, pos2, messageStart));
+    BOOST_CHECK_EQUAL(blockFileStore.GetCacheSize(), Serialize(block2).size());
+    blockFileStore.Invalidate(1);
+    BOOST_CHECK_EQUAL(blockFileStore.GetCacheSize(), 0U);
+    BOOST_CHECK(ReadRawBlockFromDisk(vch, pos2, messageStart));
+    BOOST_CHECK(vch == Serialize(block2));
+    BOOST_CHECK(ReadRawBlockFromDisk(vch, pos1, messageStart));
+    BOOST_CHECK(vch == Serialize(block1));
+    blockFileStore.SetMaxCacheSize(DEFAULT_BLOCK_CACHE_SIZE << 20);
+
+    // Positions that are not preceded by the network magic are rejected
+    blockFileStore.Clear();
+    BOOST_CHECK(!ReadRawBlockFromDisk(vch, CDiskBlockPos(1, pos1.nPos + 1), messageStart));
+    BOOST_CHECK(!ReadRawBlockFromDisk(vch, CDiskBlockPos(1, 0), messageStart));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,11 +4,17 @@
 
 #include "coins.h"
 #include "random.h"
+#include "script/standard.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "undo.h"
+#include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
+#include <limits>
 #include <vector>
 #include <map>
+#include <set>
 
 #include <boost/test/unit_test.hpp>
 
@@ -17,27 +23,27 @@ namespace
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
 
 public:
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -45,15 +51,18 @@ public:
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     {
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
-            map_[it->first] = it->second.coins;
-            if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
-                // Randomly delete empty entries on write.
-                map_.erase(it->first);
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                // Same optimization used in CCoinsViewDB is to only write dirty entries.
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
+                    // Randomly delete empty entries on write.
+                    map_.erase(it->first);
+                }
             }
             mapCoins.erase(it++);
         }
-        mapCoins.clear();
-        hashBestBlock_ = hashBlock;
+        if (!hashBlock.IsNull())
+            hashBestBlock_ = hashBlock;
         return true;
     }
 
@@ -69,12 +78,45 @@ public:
     {
         // Manually recompute the dynamic usage of the whole data, and compare it.
         size_t ret = memusage::DynamicUsage(cacheCoins);
+        size_t count = 0;
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += memusage::DynamicUsage(it->second.coins);
+            ret += it->second.coin.DynamicMemoryUsage();
+            ++count;
         }
-        BOOST_CHECK_EQUAL(memusage::DynamicUsage(*this), ret);
+        BOOST_CHECK_EQUAL(GetCacheSize(), count);
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+
+};
+
+//! Serializes a byte vector without a length prefix.
+struct RawBytes
+{
+    const std::vector<unsigned char>& data;
+    RawBytes(const std::vector<unsigned char>& dataIn) : data(dataIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const { return data.size(); }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        s.write((const char*)&data[0], data.size());
     }
+};
 
+//! Exposes the raw database to write records in the legacy format.
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    void WriteLegacy(const uint256& txid, const std::string& hex)
+    {
+        std::vector<unsigned char> data(ParseHex(hex));
+        CLevelDBBatch batch;
+        batch.Write(std::make_pair('c', txid), RawBytes(data));
+        db.WriteBatch(batch);
+    }
 };
 
 }
@@ -86,8 +128,8 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
-// txids picked from a limited list of random 256-bit hashes. Occasionally, a
+// It will randomly create/update/delete Coin entries to a tip of caches, with
+// outpoints picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
 // During the process, booleans are kept to make sure that the randomized
@@ -98,13 +140,16 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool uncached_an_entry = false;
+    bool flushed_and_trimmed = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -121,37 +166,66 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     for (unsigned int i = 0; i < NUM_SIMULATION_ITERATIONS; i++) {
         // Do a random modification.
         {
-            uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], insecure_rand() % 4); // outpoint we're going to modify in this iteration.
+            Coin& coin = result[outpoint];
+
+            // Determine whether to test HaveCoin before or after Access* (or both). As these functions
+            // can influence each other's behaviour by pulling things into the cache, all combinations
+            // are tested.
+            bool test_havecoin_before = (insecure_rand() & 0x3) == 0;
+            bool test_havecoin_after = (insecure_rand() & 0x3) == 0;
+
+            bool result_havecoin = test_havecoin_before ? stack.back()->HaveCoin(outpoint) : false;
+            const Coin& entry = stack.back()->AccessCoin(outpoint);
+            BOOST_CHECK(coin == entry);
+            BOOST_CHECK(!test_havecoin_before || result_havecoin == !entry.IsSpent());
+
+            if (test_havecoin_after) {
+                bool ret = stack.back()->HaveCoin(outpoint);
+                BOOST_CHECK(ret == !entry.IsSpent());
+            }
+
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0); // Random sizes so we can test memory usage accounting
+                    (coin.IsSpent() ? added_an_entry : updated_an_entry) = true;
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(outpoint, newcoin, !coin.IsSpent() || insecure_rand() & 1);
             } else {
-                coins.Clear();
-                entry->Clear();
                 removed_an_entry = true;
+                coin.Clear();
+                stack.back()->SpendCoin(outpoint);
             }
         }
 
+        // One every 10 iterations, remove a random entry from the cache
+        if (insecure_rand() % 10 == 0) {
+            COutPoint outpoint(txids[insecure_rand() % txids.size()], 0);
+            int cacheid = insecure_rand() % stack.size();
+            stack[cacheid]->Uncache(outpoint);
+            uncached_an_entry |= !stack[cacheid]->HaveCoinInCache(outpoint);
+        }
+
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -159,14 +233,29 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
             }
         }
 
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, flush an intermediate cache
+            if (stack.size() > 1 && insecure_rand() % 2 == 0) {
+                unsigned int flushIndex = insecure_rand() % (stack.size() - 1);
+                if (insecure_rand() % 2 == 0) {
+                    stack[flushIndex]->Flush();
+                } else {
+                    // Keep a random part of it cached
+                    stack[flushIndex]->FlushAndTrim(insecure_rand() % (stack[flushIndex]->DynamicMemoryUsage() + 1));
+                    flushed_and_trimmed = true;
+                }
+            }
+        }
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+                //Remove the top cache
                 stack.back()->Flush();
                 delete stack.back();
                 stack.pop_back();
             }
             if (stack.size() == 0 || (stack.size() < 4 && insecure_rand() % 2)) {
+                //Add a new cache
                 CCoinsView* tip = &base;
                 if (stack.size() > 0) {
                     tip = stack.back();
@@ -191,10 +280,259 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(uncached_an_entry);
+    BOOST_CHECK(flushed_and_trimmed);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_trim)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 1000; i++) {
+        CTxOut out;
+        out.nValue = i;
+        out.scriptPubKey.assign(1000, OP_TRUE);
+        outpoints.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(outpoints.back(), Coin(out, 1, false), false);
+    }
+
+    // Modified entries are written, but stay cached while there is room.
+    BOOST_CHECK(cache.FlushAndTrim(std::numeric_limits<size_t>::max()));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1000U);
+    for (unsigned int i = 0; i < outpoints.size(); i++)
+        BOOST_CHECK(base.HaveCoin(outpoints[i]));
+
+    // Spending is written through too; the spent entry is dropped.
+    BOOST_CHECK(cache.SpendCoin(outpoints[0]));
+    BOOST_CHECK(cache.FlushAndTrim(std::numeric_limits<size_t>::max()));
+    Coin coin;
+    BOOST_CHECK(!base.GetCoin(outpoints[0], coin) || coin.IsSpent());
+    BOOST_CHECK(!cache.HaveCoinInCache(outpoints[0]));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 999U);
+    cache.SelfTest();
+
+    // Evicting a single entry takes the clock hand all the way round,
+    // clearing every entry's accessed flag.
+    BOOST_CHECK(cache.FlushAndTrim(cache.DynamicMemoryUsage() - 1));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 998U);
+
+    // Entries looked up since then survive a trim to half the size.
+    std::vector<COutPoint> hot;
+    for (unsigned int i = 1; i < outpoints.size() && hot.size() < 100; i++) {
+        if (cache.HaveCoinInCache(outpoints[i])) {
+            BOOST_CHECK(!cache.AccessCoin(outpoints[i]).IsSpent());
+            hot.push_back(outpoints[i]);
+        }
+    }
+    size_t nTarget = cache.DynamicMemoryUsage() / 2;
+    BOOST_CHECK(cache.FlushAndTrim(nTarget));
+    BOOST_CHECK(cache.DynamicMemoryUsage() <= nTarget);
+    BOOST_CHECK(cache.GetCacheSize() < 998U);
+    for (unsigned int i = 0; i < hot.size(); i++)
+        BOOST_CHECK(cache.HaveCoinInCache(hot[i]));
+    cache.SelfTest();
+
+    // Evicted coins are still found in the base view.
+    for (unsigned int i = 1; i < outpoints.size(); i++)
+        BOOST_CHECK(cache.HaveCoin(outpoints[i]));
+
+    // Modified entries evicted by the same flush are written as well.
+    std::vector<COutPoint> added;
+    for (int i = 0; i < 100; i++) {
+        CTxOut out;
+        out.nValue = i;
+        out.scriptPubKey.assign(1000, OP_TRUE);
+        added.push_back(COutPoint(GetRandHash(), 0));
+        cache.AddCoin(added.back(), Coin(out, 2, false), false);
+    }
+    BOOST_CHECK(cache.FlushAndTrim(0));
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+    for (unsigned int i = 0; i < added.size(); i++) {
+        BOOST_CHECK(base.GetCoin(added[i], coin));
+        BOOST_CHECK_EQUAL(coin.out.nValue, (CAmount)i);
+    }
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(coins_stats_incremental)
+{
+    std::vector<std::pair<COutPoint, Coin> > coins;
+    for (int i = 0; i < 3; i++) {
+        CTxOut out;
+        out.nValue = 1000 * (i + 1);
+        out.scriptPubKey.assign(i + 1, OP_TRUE);
+        coins.push_back(std::make_pair(COutPoint(GetRandHash(), i), Coin(out, 100 + i, i == 0)));
+    }
+
+    CCoinsStats forward, backward, partial;
+    for (unsigned int i = 0; i < coins.size(); i++) {
+        forward.AddCoin(coins[i].first, coins[i].second);
+        backward.AddCoin(coins[coins.size() - 1 - i].first, coins[coins.size() - 1 - i].second);
+    }
+    BOOST_CHECK_EQUAL(forward.nTransactionOutputs, 3U);
+    BOOST_CHECK_EQUAL(forward.nTotalAmount, 6000);
+    BOOST_CHECK(forward.GetHashSerialized() == backward.GetHashSerialized());
+    BOOST_CHECK_EQUAL(forward.nSerializedSize, backward.nSerializedSize);
+
+    // Removing an output gives the statistics of the set without it
+    partial.AddCoin(coins[0].first, coins[0].second);
+    partial.AddCoin(coins[2].first, coins[2].second);
+    forward.RemoveCoin(coins[1].first, coins[1].second);
+    BOOST_CHECK(forward.GetHashSerialized() == partial.GetHashSerialized());
+    BOOST_CHECK_EQUAL(forward.nTransactionOutputs, partial.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(forward.nSerializedSize, partial.nSerializedSize);
+    BOOST_CHECK_EQUAL(forward.nTotalAmount, partial.nTotalAmount);
+
+    // The hash commits to the outpoint and to the coin's metadata
+    CCoinsStats moved, reheighted;
+    moved.AddCoin(COutPoint(coins[0].first.hash, 7), coins[0].second);
+    Coin coin = coins[0].second;
+    coin.nHeight++;
+    reheighted.AddCoin(coins[0].first, coin);
+    CCoinsStats single;
+    single.AddCoin(coins[0].first, coins[0].second);
+    BOOST_CHECK(moved.GetHashSerialized() != single.GetHashSerialized());
+    BOOST_CHECK(reheighted.GetHashSerialized() != single.GetHashSerialized());
+
+    // Removing everything gets back to the empty set
+    single.RemoveCoin(coins[0].first, coins[0].second);
+    BOOST_CHECK(single.GetHashSerialized() == CCoinsStats().GetHashSerialized());
+    BOOST_CHECK_EQUAL(single.nTransactionOutputs, 0U);
+    BOOST_CHECK_EQUAL(single.nSerializedSize, 0U);
+    BOOST_CHECK_EQUAL(single.nTotalAmount, 0);
+
+    // The statistics survive a round trip through the database format
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << partial;
+    CCoinsStats read;
+    ss >> read;
+    BOOST_CHECK(read.GetHashSerialized() == partial.GetHashSerialized());
+    read.AddCoin(coins[1].first, coins[1].second);
+    BOOST_CHECK(read.GetHashSerialized() == backward.GetHashSerialized());
+}
+
+BOOST_AUTO_TEST_CASE(coin_serialization)
+{
+    // Good example
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin c1;
+    ss1 >> c1;
+    BOOST_CHECK_EQUAL(c1.IsCoinBase(), false);
+    BOOST_CHECK_EQUAL(c1.nHeight, 203998U);
+    BOOST_CHECK_EQUAL(c1.out.nValue, 60000000000LL);
+    BOOST_CHECK_EQUAL(HexStr(c1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+
+    // Good example
+    CDataStream ss2(ParseHex("8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin c2;
+    ss2 >> c2;
+    BOOST_CHECK_EQUAL(c2.IsCoinBase(), true);
+    BOOST_CHECK_EQUAL(c2.nHeight, 120891U);
+    BOOST_CHECK_EQUAL(c2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(c2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+
+    // Round trip
+    CDataStream ss3(SER_DISK, CLIENT_VERSION);
+    ss3 << c1;
+    BOOST_CHECK_EQUAL(HexStr(ss3.begin(), ss3.end()), "97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+}
+
+BOOST_AUTO_TEST_CASE(txundo_legacy_format)
+{
+    // Undo records written by the per-transaction format carry a version
+    // after the height; it must still be readable and is written as zero.
+    CDataStream ss(ParseHex("01" "97f23c01" "835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    CTxUndo undo;
+    ss >> undo;
+    BOOST_CHECK_EQUAL(undo.vprevout.size(), 1U);
+    BOOST_CHECK_EQUAL(undo.vprevout[0].nHeight, 203998U);
+    BOOST_CHECK_EQUAL(undo.vprevout[0].out.nValue, 60000000000LL);
+
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << undo;
+    BOOST_CHECK_EQUAL(HexStr(ss2.begin(), ss2.end()), "01" "97f23c00" "835800816115944e077fe7c803cfa57f29b36bf87c1d35");
+    BOOST_CHECK_EQUAL(ss2.size(), ::GetSerializeSize(undo, SER_DISK, CLIENT_VERSION));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade)
+{
+    CCoinsViewDBTest db;
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+    // version 1, vout[1] unspent at height 203998
+    db.WriteLegacy(txid1, "0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e");
+    // version 1, coinbase, vout[0] unspent at height 120891
+    db.WriteLegacy(txid2, "0103bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b");
+    BOOST_CHECK(!db.HaveCoin(COutPoint(txid1, 1)));
+
+    BOOST_CHECK(db.Upgrade());
+
+    Coin coin;
+    BOOST_CHECK(!db.HaveCoin(COutPoint(txid1, 0)));
+    BOOST_CHECK(db.GetCoin(COutPoint(txid1, 1), coin));
+    BOOST_CHECK_EQUAL(coin.nHeight, 203998U);
+    BOOST_CHECK_EQUAL(coin.IsCoinBase(), false);
+    BOOST_CHECK_EQUAL(coin.out.nValue, 60000000000LL);
+    BOOST_CHECK(db.GetCoin(COutPoint(txid2, 0), coin));
+    BOOST_CHECK_EQUAL(coin.nHeight, 120891U);
+    BOOST_CHECK_EQUAL(coin.IsCoinBase(), true);
+    BOOST_CHECK_EQUAL(coin.out.nValue, 110397);
+
+    // A second run finds nothing left to convert.
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.HaveCoin(COutPoint(txid1, 1)));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_cursor)
+{
+    CCoinsViewDBTest db;
+    std::map<COutPoint, Coin> coins;
+    CCoinsMap mapCoins;
+    for (unsigned int i = 0; i < 200; i++) {
+        COutPoint outpoint(GetRandHash(), insecure_rand() % 300);
+        CCoinsCacheEntry& entry = mapCoins[outpoint];
+        entry.coin.out.nValue = 1 + insecure_rand() % 1000;
+        entry.coin.nHeight = 1;
+        entry.flags = CCoinsCacheEntry::DIRTY;
+        coins[outpoint] = entry.coin;
+    }
+    BOOST_CHECK(db.BatchWrite(mapCoins, GetRandHash()));
+
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor(db.Cursor());
+
+    // Changes after the cursor is created are not visible through it.
+    CCoinsMap mapSpend;
+    mapSpend[coins.begin()->first].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(db.BatchWrite(mapSpend, uint256()));
+    BOOST_CHECK(!db.HaveCoin(coins.begin()->first));
+
+    // All coins are visited once, and outputs of a transaction are adjacent.
+    std::set<uint256> setDone;
+    uint256 hashPrev;
+    CCoinsStats stats, statsExpected;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        COutPoint outpoint;
+        Coin coin;
+        BOOST_CHECK(pcursor->GetEntry(outpoint, coin));
+        BOOST_CHECK(coins.count(outpoint));
+        BOOST_CHECK(coin.out == coins[outpoint].out);
+        if (outpoint.hash != hashPrev) {
+            BOOST_CHECK(setDone.insert(outpoint.hash).second);
+            hashPrev = outpoint.hash;
+        }
+        stats.AddCoin(outpoint, coin);
+    }
+    for (std::map<COutPoint, Coin>::const_iterator it = coins.begin(); it != coins.end(); it++)
+        statsExpected.AddCoin(it->first, it->second);
+    BOOST_CHECK_EQUAL(stats.nTransactionOutputs, coins.size());
+    BOOST_CHECK(stats.GetHashSerialized() == statsExpected.GetHashSerialized());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,163 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsflush.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(coinsflush_tests, BasicTestingSetup)
+
+namespace {
+//! In-memory coin view whose writes can be held up until released
+class CCoinsViewSlow : public CCoinsView
+{
+public:
+    mutable boost::mutex mutex;
+    boost::condition_variable cond;
+    std::map<COutPoint, Coin> mapCoins;
+    uint256 hashBestBlock;
+    bool fHold;
+    bool fWriting;
+    bool fFail;
+
+    CCoinsViewSlow() : fHold(false), fWriting(false), fFail(false) {}
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<COutPoint, Coin>::const_iterator it = mapCoins.find(outpoint);
+        if (it == mapCoins.end())
+            return false;
+        coin = it->second;
+        return true;
+    }
+
+    bool HaveCoin(const COutPoint& outpoint) const
+    {
+        Coin coin;
+        return GetCoin(outpoint, coin);
+    }
+
+    uint256 GetBestBlock() const
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return hashBestBlock;
+    }
+
+    bool BatchWrite(CCoinsMap& mapWrite, const uint256& hashBlock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fWriting = true;
+        cond.notify_all();
+        while (fHold)
+            cond.wait(lock);
+        fWriting = false;
+        if (fFail)
+            return false;
+        for (CCoinsMap::const_iterator it = mapWrite.begin(); it != mapWrite.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            if (it->second.coin.IsSpent())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coin;
+        }
+        if (!hashBlock.IsNull())
+            hashBestBlock = hashBlock;
+        return true;
+    }
+
+    void Hold()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fHold = true;
+    }
+
+    void WaitWriting()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fWriting)
+            cond.wait(lock);
+    }
+
+    void Release()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fHold = false;
+        cond.notify_all();
+    }
+};
+
+Coin MakeCoin(int nHeight)
+{
+    CTxOut out;
+    out.nValue = nHeight;
+    out.scriptPubKey.assign(1, 0x51);
+    return Coin(out, nHeight, false);
+}
+}
+
+BOOST_AUTO_TEST_CASE(coinsflush_snapshot)
+{
+    CCoinsViewSlow base;
+    COutPoint outpointOld(GetRandHash(), 0), outpointNew(GetRandHash(), 1);
+    base.mapCoins[outpointOld] = MakeCoin(1);
+
+    CCoinsViewFlusher flusher(&base);
+    CCoinsViewCache cache(&flusher);
+    uint256 hashBlock = GetRandHash();
+
+    BOOST_CHECK(cache.SpendCoin(outpointOld));
+    cache.AddCoin(outpointNew, MakeCoin(2), false);
+    cache.SetBestBlock(hashBlock);
+
+    // The flush returns while the base view is still writing...
+    BOOST_CHECK_EQUAL(flusher.DynamicMemoryUsage(), 0U);
+    base.Hold();
+    BOOST_CHECK(cache.Flush());
+    base.WaitWriting();
+    BOOST_CHECK(flusher.DynamicMemoryUsage() > 0);
+    BOOST_CHECK(base.mapCoins.count(outpointOld));
+    BOOST_CHECK(!base.mapCoins.count(outpointNew));
+
+    // ...and the snapshot is visible to a fresh cache meanwhile.
+    CCoinsViewCache cacheAfter(&flusher);
+    BOOST_CHECK(!cacheAfter.HaveCoin(outpointOld));
+    BOOST_CHECK(cacheAfter.HaveCoin(outpointNew));
+    BOOST_CHECK(cacheAfter.AccessCoin(outpointNew).nHeight == 2);
+    BOOST_CHECK(flusher.GetBestBlock() == hashBlock);
+
+    base.Release();
+    BOOST_CHECK(flusher.Sync());
+    BOOST_CHECK_EQUAL(flusher.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK(!base.mapCoins.count(outpointOld));
+    BOOST_CHECK(base.mapCoins.count(outpointNew));
+    BOOST_CHECK(base.GetBestBlock() == hashBlock);
+    BOOST_CHECK(flusher.HaveCoin(outpointNew));
+    BOOST_CHECK(!flusher.HaveCoin(outpointOld));
+}
+
+BOOST_AUTO_TEST_CASE(coinsflush_failure)
+{
+    CCoinsViewSlow base;
+    base.fFail = true;
+    CCoinsViewFlusher flusher(&base);
+    CCoinsViewCache cache(&flusher);
+
+    cache.AddCoin(COutPoint(GetRandHash(), 0), MakeCoin(1), false);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!flusher.Sync());
+
+    // Later writes are refused
+    cache.AddCoin(COutPoint(GetRandHash(), 0), MakeCoin(2), false);
+    BOOST_CHECK(!cache.Flush());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,8 @@
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "crypto/muhash.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -131,6 +133,22 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64) {
+    // Each 64-byte block must hash to the same value as the generic double
+    // SHA256, whichever way SHA256D64 splits the blocks up internally.
+    static const size_t nBlockCounts[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 16, 17};
+    for (unsigned int n = 0; n < sizeof(nBlockCounts) / sizeof(nBlockCounts[0]); n++) {
+        size_t blocks = nBlockCounts[n];
+        std::vector<unsigned char> in(64 * blocks), out1(32 * blocks), out2(32 * blocks);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = insecure_rand() & 0xff;
+        for (size_t i = 0; i < blocks; i++)
+            CHash256().Write(&in[64 * i], 64).Finalize(&out1[32 * i]);
+        SHA256D64(&out2[0], &in[0], blocks);
+        BOOST_CHECK(out1 == out2);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -248,4 +266,55 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+static std::string MuHashDigest(const MuHash3072& muhash)
+{
+    unsigned char out[32];
+    muhash.Finalize(out);
+    return HexStr(out, out + sizeof(out));
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests) {
+    const unsigned char elements[3] = {0, 1, 2};
+
+    // Known answers for {} and {0, 1} / {2}
+    MuHash3072 empty;
+    BOOST_CHECK_EQUAL(MuHashDigest(empty), "c85525462fdcf30a2c18d6f4b92923000974355c2477f59594d2c205a1d25add");
+    MuHash3072 set;
+    set.Insert(&elements[0], 1).Insert(&elements[1], 1).Remove(&elements[2], 1);
+    BOOST_CHECK_EQUAL(MuHashDigest(set), "e198cd63d598a1a0dd8ecb5a66046facedb1effda60e640f0413f0f1c01e87b9");
+
+    // The order of updates does not matter, and removing undoes inserting
+    MuHash3072 reordered;
+    reordered.Remove(&elements[2], 1).Insert(&elements[1], 1).Insert(&elements[2], 1).Insert(&elements[0], 1).Remove(&elements[2], 1);
+    BOOST_CHECK_EQUAL(MuHashDigest(reordered), MuHashDigest(set));
+    MuHash3072 roundtrip;
+    roundtrip.Insert(&elements[1], 1).Remove(&elements[1], 1);
+    BOOST_CHECK_EQUAL(MuHashDigest(roundtrip), MuHashDigest(empty));
+    BOOST_CHECK(MuHashDigest(MuHash3072().Insert(&elements[0], 1)) != MuHashDigest(MuHash3072().Insert(&elements[1], 1)));
+
+    // Combining hashes of disjoint sets
+    MuHash3072 left, right;
+    left.Insert(&elements[0], 1);
+    right.Insert(&elements[1], 1).Remove(&elements[2], 1);
+    left *= right;
+    BOOST_CHECK_EQUAL(MuHashDigest(left), MuHashDigest(set));
+
+    // The state survives serialization
+    unsigned char bytes[MuHash3072::SERIALIZED_SIZE];
+    set.ToBytes(bytes);
+    MuHash3072 read;
+    read.FromBytes(bytes);
+    BOOST_CHECK_EQUAL(MuHashDigest(read), MuHashDigest(set));
+
+    // A number times its inverse is one, also for an input that needs reducing
+    for (int i = 0; i < 2; i++) {
+        unsigned char data[Num3072::BYTE_SIZE];
+        for (size_t j = 0; j < sizeof(data); j++)
+            data[j] = i ? 0xff : insecure_rand() & 0xff;
+        Num3072 x(data);
+        x.Multiply(x.GetInverse());
+        BOOST_CHECK(memcmp(x.limbs, Num3072().limbs, sizeof(x.limbs)) == 0);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
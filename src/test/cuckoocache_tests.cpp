@@ -0,0 +1,79 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "cuckoocache.h"
+#include "crypto/common.h"
+#include "random.h"
+#include "uint256.h"
+
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(cuckoocache_tests, BasicTestingSetup)
+
+namespace {
+class UInt256Hasher
+{
+public:
+    uint32_t operator()(const uint256& key, unsigned int n) const
+    {
+        return ReadLE32(key.begin() + 4 * n);
+    }
+};
+
+typedef CuckooCache<uint256, UInt256Hasher> uint256_cache;
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_empty)
+{
+    uint256_cache cc;
+    // Unsized cache stores nothing
+    uint256 h = GetRandHash();
+    cc.insert(h);
+    BOOST_CHECK(!cc.contains(h));
+
+    BOOST_CHECK_EQUAL(cc.setup_bytes(32 * 1024), 1024U);
+    BOOST_CHECK(!cc.contains(h));
+    cc.insert(h);
+    BOOST_CHECK(cc.contains(h));
+
+    cc.clear();
+    BOOST_CHECK(!cc.contains(h));
+}
+
+BOOST_AUTO_TEST_CASE(cuckoocache_hit_rate)
+{
+    // Filling to half capacity should keep everything.
+    uint256_cache cc;
+    cc.setup(1 << 12);
+    std::vector<uint256> hashes;
+    for (unsigned int i = 0; i < (1 << 11); i++) {
+        hashes.push_back(GetRandHash());
+        cc.insert(hashes.back());
+    }
+    for (unsigned int i = 0; i < hashes.size(); i++)
+        BOOST_CHECK(cc.contains(hashes[i]));
+
+    // Overfilling evicts some of the older entries, but most of the newest
+    // ones must still be present and the size stays bounded.
+    std::vector<uint256> newer;
+    for (unsigned int i = 0; i < (1 << 13); i++) {
+        newer.push_back(GetRandHash());
+        cc.insert(newer.back());
+    }
+    BOOST_CHECK_EQUAL(cc.capacity(), 1U << 12);
+    unsigned int nOld = 0;
+    for (unsigned int i = 0; i < hashes.size(); i++)
+        nOld += cc.contains(hashes[i]);
+    unsigned int nRecent = 0;
+    for (unsigned int i = newer.size() - 1024; i < newer.size(); i++)
+        nRecent += cc.contains(newer[i]);
+    BOOST_CHECK(nOld < hashes.size());
+    BOOST_CHECK(nRecent > 850);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -188,4 +188,34 @@ BOOST_AUTO_TEST_CASE(key_test1)
     BOOST_CHECK(detsigc == ParseHex("2052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
 }
 
+BOOST_AUTO_TEST_CASE(key_lax_der)
+{
+    // Signatures that are not strict DER must still be accepted the way
+    // OpenSSL accepted them before BIP66.
+    CBitcoinSecret bsecret1;
+    BOOST_CHECK(bsecret1.SetString(strSecret1));
+    CKey key1 = bsecret1.GetKey();
+    CPubKey pubkey1 = key1.GetPubKey();
+
+    string strMsg = "Very deterministic message";
+    uint256 hashMsg = Hash(strMsg.begin(), strMsg.end());
+    const string strR = "205dbbddda71772d95ce91cd2d14b592cfbc1dd0aabd6a394b6c2d377bbe59d31d";
+    const string strS = "2014ddda21494a4e221f0824f0b8b924c43fa43c0ad57dccdaa11f81a6bd4582f6";
+
+    // Strict encoding
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("304402" + strR + "02" + strS)));
+    // Excess zero padding in R
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("30450221" + string("00") + strR.substr(2) + "02" + strS)));
+    // Long-form length descriptors
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("30814402" + strR + "02" + strS)));
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("3045028120" + strR.substr(2) + "02" + strS)));
+    // Garbage at the end
+    BOOST_CHECK(pubkey1.Verify(hashMsg, ParseHex("304402" + strR + "02" + strS + "0101")));
+    // Wrong message, truncated and overflowing encodings still fail
+    BOOST_CHECK(!pubkey1.Verify(Hash(strMsg.begin(), strMsg.end() - 1), ParseHex("304402" + strR + "02" + strS)));
+    BOOST_CHECK(!pubkey1.Verify(hashMsg, ParseHex("304402" + strR + "02" + strS.substr(0, 40))));
+    BOOST_CHECK(!pubkey1.Verify(hashMsg, ParseHex("30450221ff" + strR.substr(2) + "02" + strS)));
+    BOOST_CHECK(!pubkey1.Verify(hashMsg, std::vector<unsigned char>()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
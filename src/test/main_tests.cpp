@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "blockstore.h"
 #include "chainparams.h"
 #include "main.h"
 
@@ -73,4 +74,22 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(read_raw_block)
+{
+    const CBlockIndex* pindex = chainActive.Genesis();
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pindex));
+    std::vector<unsigned char> vchBlock;
+    BOOST_CHECK(ReadRawBlockFromDisk(vchBlock, pindex, Params().MessageStart()));
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    BOOST_CHECK(std::vector<unsigned char>(ssBlock.begin(), ssBlock.end()) == vchBlock);
+
+    // A wrong network magic is rejected (once the block has to come from the file)
+    blockFileStore.Clear();
+    CMessageHeader::MessageStartChars badStart = {0, 0, 0, 0};
+    BOOST_CHECK(!ReadRawBlockFromDisk(vchBlock, pindex, badStart));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
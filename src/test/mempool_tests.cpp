@@ -101,4 +101,141 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+static CMutableTransaction MakeChainedTx(const COutPoint& prevout, opcodetype op)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = CScript() << op;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << op << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    return tx;
+}
+
+static unsigned int TxSize(const CMutableTransaction& tx)
+{
+    return ::GetSerializeSize(CTransaction(tx), SER_NETWORK, PROTOCOL_VERSION);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // A chain of three transactions: tx1 <- tx2 <- tx3
+    CMutableTransaction tx1 = MakeChainedTx(COutPoint(), OP_1);
+    CMutableTransaction tx2 = MakeChainedTx(COutPoint(tx1.GetHash(), 0), OP_2);
+    CMutableTransaction tx3 = MakeChainedTx(COutPoint(tx2.GetHash(), 0), OP_3);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000LL, 0, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 2000LL, 0, 0.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 3000LL, 0, 0.0, 1));
+    uint64_t nChainSize = TxSize(tx1) + TxSize(tx2) + TxSize(tx3);
+
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx1.GetHash());
+    CTxMemPool::txiter it2 = pool.mapTx.find(tx2.GetHash());
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3.GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it1->GetSizeWithDescendants(), nChainSize);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6000LL);
+    BOOST_CHECK_EQUAL(it1->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it2->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), nChainSize);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6000LL);
+
+    // Fee deltas propagate to both ancestors and descendants
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0.0, 500LL);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6500LL);
+    BOOST_CHECK_EQUAL(it2->GetModifiedFee(), 2500LL);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6500LL);
+
+    // The ancestor limit counts the new transaction itself
+    CMutableTransaction tx4 = MakeChainedTx(COutPoint(tx3.GetHash(), 0), OP_4);
+    CTxMemPoolEntry entry4(tx4, 4000LL, 0, 0.0, 1);
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry4, setAncestors, 3, nNoLimit, nNoLimit, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry4, setAncestors, nNoLimit, nNoLimit, 3, nNoLimit, errString));
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry4, setAncestors, 4, nNoLimit, 4, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+
+    // Confirming tx1 leaves its descendants with one ancestor less
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx1);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vtx, 2, conflicts);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 5500LL);
+    BOOST_CHECK_EQUAL(it2->GetCountWithDescendants(), 2);
+
+    // Removing tx2 recursively takes tx3 along
+    std::list<CTransaction> removed;
+    pool.remove(tx2, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    pool.ClearPrioritisation(tx2.GetHash());
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    CMutableTransaction tx1 = MakeChainedTx(COutPoint(), OP_1);
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 10.0, 1, pool.HasNoInputsOf(tx1)));
+
+    CMutableTransaction tx2 = MakeChainedTx(COutPoint(), OP_2);
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1, pool.HasNoInputsOf(tx2)));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage()); // should do nothing
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // should remove the lower-feerate transaction
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1, pool.HasNoInputsOf(tx2)));
+    CMutableTransaction tx3 = MakeChainedTx(COutPoint(tx2.GetHash(), 0), OP_3);
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 0, 10.0, 1, pool.HasNoInputsOf(tx3)));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4); // tx3 should pay for tx2 (CPFP)
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    std::vector<COutPoint> vNoSpendsRemaining;
+    pool.TrimToSize(TxSize(tx1), &vNoSpendsRemaining); // nothing fits in tx1's size
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+    // The confirmed inputs of tx1 and tx2 are no longer spent in the mempool;
+    // tx3's input was an evicted transaction.
+    BOOST_CHECK_EQUAL(vNoSpendsRemaining.size(), 2);
+
+    CFeeRate maxFeeRateRemoved(25000, TxSize(tx2) + TxSize(tx3));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    // The minimum fee only starts to decay once a block has been seen
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(42 + 2*CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), (maxFeeRateRemoved.GetFeePerK() + 1000)/2);
+
+    // ... and drops to zero once it falls below half the relay fee
+    SetMockTime(42 + 12*CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -100,4 +100,29 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blockindex_arena_test)
+{
+    CBlockIndexArena arena;
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < (int)CBlockIndexArena::SLAB_SIZE * 2 + 10; i++) {
+        CBlockIndex index;
+        index.nHeight = i;
+        index.pprev = vIndex.empty() ? NULL : vIndex.back();
+        vIndex.push_back(arena.Allocate(index));
+    }
+    BOOST_CHECK_EQUAL(arena.size(), vIndex.size());
+
+    // Entries keep their address and contents as more are allocated.
+    for (int i = 0; i < (int)vIndex.size(); i++) {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+        BOOST_CHECK(vIndex[i]->pprev == (i ? vIndex[i - 1] : NULL));
+    }
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    CBlockIndex* pindex = arena.Allocate();
+    BOOST_CHECK_EQUAL(pindex->nHeight, 0);
+    BOOST_CHECK_EQUAL(arena.size(), 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,6 +6,7 @@
 
 #include "test_bitcoin.h"
 
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "random.h"
@@ -29,8 +30,10 @@ extern void noui_connect();
 
 BasicTestingSetup::BasicTestingSetup()
 {
+        SHA256AutoDetect();
         ECC_Start();
         SetupEnvironment();
+        InitSignatureCache();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::MAIN);
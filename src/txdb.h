@@ -14,6 +14,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
@@ -26,6 +28,8 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
+class CCoinsViewDBCursor;
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -34,11 +38,65 @@ protected:
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Iterate over the unspent outputs in key order, as of the time the cursor is created. The caller owns the result.
+    CCoinsViewDBCursor *Cursor() const;
+
+    //! Attempt to update from an older database format. Returns whether an error occurred.
+    bool Upgrade();
+};
+
+/** Iterator over the unspent outputs in a CCoinsViewDB, ordered by outpoint (txid, then VARINT(n)) */
+class CCoinsViewDBCursor
+{
+public:
+    bool Valid() const;
+    void Next();
+    //! Get the outpoint and unspent output at the cursor; false on a deserialization error.
+    bool GetEntry(COutPoint &outpoint, Coin &coin) const;
+
+private:
+    CCoinsViewDBCursor(leveldb::Iterator* pcursorIn) : pcursor(pcursorIn) {}
+    boost::scoped_ptr<leveldb::Iterator> pcursor;
+
+    friend class CCoinsViewDB;
+};
+
+/**
+ * Fields of the block index that are derived from the stored entries, saved
+ * at a clean shutdown so that the next startup does not need to recompute
+ * them. Entries are listed by height, so parents come before their children.
+ */
+struct CBlockIndexCache
+{
+    static const int CURRENT_VERSION = 1;
+    //! vSkip value of entries without a skip pointer
+    static const uint32_t NO_SKIP = 0xffffffff;
+
+    int nVersion;
+    //! Hashes of all entries in the block index, ordered by height
+    std::vector<uint256> vHash;
+    //! nChainWork of each entry
+    std::vector<uint256> vChainWork;
+    //! Position in vHash of the target of each entry's pskip
+    std::vector<uint32_t> vSkip;
+
+    CBlockIndexCache() : nVersion(CURRENT_VERSION) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn) {
+        READWRITE(nVersion);
+        READWRITE(vHash);
+        READWRITE(vChainWork);
+        READWRITE(vSkip);
+    }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -57,6 +115,11 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadUTXOStats(CCoinsStats &stats);
+    bool WriteUTXOStats(const CCoinsStats &stats);
+    bool ReadBlockIndexCache(CBlockIndexCache &cache);
+    bool WriteBlockIndexCache(const CBlockIndexCache &cache);
+    bool EraseBlockIndexCache();
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
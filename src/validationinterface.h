@@ -6,6 +6,8 @@
 #ifndef BITCOIN_VALIDATIONINTERFACE_H
 #define BITCOIN_VALIDATIONINTERFACE_H
 
+#include <list>
+
 #include <boost/signals2/signal.hpp>
 
 class CBlock;
@@ -25,11 +27,15 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
+/** Push the transactions of a connected block, and those it conflicted, to all registered wallets */
+void SyncBlockWithWallets(const CBlock& block, const std::list<CTransaction>& txConflicted);
 
 class CValidationInterface {
 protected:
     virtual void UpdatedBlockTip(const uint256 &newHashTip) {}
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
+    /** Calls SyncTransaction for the conflicted transactions, then for those of the block */
+    virtual void BlockConnected(const CBlock &block, const std::list<CTransaction> &txConflicted);
     virtual void EraseFromWallet(const uint256 &hash) {}
     virtual void SetBestChain(const CBlockLocator &locator) {}
     virtual void UpdatedTransaction(const uint256 &hash) {}
@@ -46,6 +52,8 @@ struct CMainSignals {
     boost::signals2::signal<void (const uint256 &)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
+    /** Notifies listeners of a connected block, and of the transactions it conflicted. */
+    boost::signals2::signal<void (const CBlock &, const std::list<CTransaction> &)> BlockConnected;
     /** Notifies listeners of an erased transaction (currently disabled, requires transaction replacement). */
     boost::signals2::signal<void (const uint256 &)> EraseTransaction;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
@@ -0,0 +1,120 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/coinselection.h"
+
+#include "random.h"
+
+using namespace std;
+
+bool SelectCoinsExactMatch(const vector<CAmount>& vValue, const CAmount& nTargetValue,
+                           vector<char>& vfBest, CAmount& nBest, unsigned int nMaxTries)
+{
+    // vRemaining[i] is the sum of the candidates from i on, to cut off
+    // branches that cannot reach the target anymore.
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1];
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    // Depth-first search, trying to include each coin before excluding it
+    vector<char> vfIncluded(vValue.size(), false);
+    vector<unsigned int> vIncluded;
+    CAmount nTotal = 0;
+    unsigned int i = 0;
+    for (unsigned int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest.swap(vfIncluded);
+            nBest = nTotal;
+            return true;
+        }
+        if (i < vValue.size() && nTotal + vValue[i] <= nTargetValue && nTotal + vRemaining[i] >= nTargetValue)
+        {
+            nTotal += vValue[i];
+            vfIncluded[i] = true;
+            vIncluded.push_back(i++);
+            continue;
+        }
+        if (i < vValue.size() && nTotal + vRemaining[i + 1] >= nTargetValue)
+        {
+            // Coin i overshoots, but the smaller ones after it may still do
+            i++;
+            continue;
+        }
+
+        // Dead end: exclude the last included coin instead. Coins of the same
+        // value right after it are excluded too, as including one of those
+        // would only repeat sums already tried.
+        if (vIncluded.empty())
+            return false;
+        unsigned int j = vIncluded.back();
+        vIncluded.pop_back();
+        nTotal -= vValue[j];
+        vfIncluded[j] = false;
+        for (i = j + 1; i < vValue.size() && vValue[i] == vValue[j]; i++);
+    }
+    return false;
+}
+
+void ApproximateBestSubset(const vector<CAmount>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                           vector<char>& vfBest, CAmount& nBest, int iterations)
+{
+    vector<char> vfIncluded;
+
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
+
+    seed_insecure_rand();
+
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    {
+        vfIncluded.assign(vValue.size(), false);
+        CAmount nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (unsigned int i = 0; i < vValue.size(); i++)
+            {
+                //The solver here uses a randomized algorithm,
+                //the randomness serves no real security purpose but is just
+                //needed to prevent degenerate behavior and it is important
+                //that the rng is fast. We do not use a constant random sequence,
+                //because there may be some privacy improvement by making
+                //the selection random.
+                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
+                {
+                    nTotal += vValue[i];
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i];
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool SelectCoinsLargestFirst(const vector<CAmount>& vValue, const CAmount& nTargetValue,
+                             vector<char>& vfBest, CAmount& nBest)
+{
+    vfBest.assign(vValue.size(), false);
+    nBest = 0;
+    for (unsigned int i = 0; i < vValue.size() && nBest < nTargetValue; i++)
+    {
+        vfBest[i] = true;
+        nBest += vValue[i];
+    }
+    return nBest >= nTargetValue;
+}
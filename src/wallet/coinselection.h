@@ -0,0 +1,48 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_COINSELECTION_H
+#define BITCOIN_WALLET_COINSELECTION_H
+
+#include "amount.h"
+
+#include <vector>
+
+/** Maximum number of steps the exact match search takes before giving up */
+static const unsigned int COINSELECTION_EXACT_MAX_TRIES = 100000;
+/** Above this many candidates, the stochastic approximation gives way to largest-first */
+static const unsigned int COINSELECTION_MAX_STOCHASTIC_COINS = 1000;
+
+/**
+ * Coin selection algorithms. Each picks a subset of vValue, the values of
+ * the candidate coins sorted from largest to smallest, whose sum reaches
+ * nTargetValue. The subset is returned as flags in vfBest, and its sum in
+ * nBest. SelectCoinsMinConf combines them, and decides between their result
+ * and a single larger coin.
+ */
+
+/**
+ * Branch-and-bound search for a subset summing to exactly nTargetValue.
+ * Gives up after nMaxTries steps, so the time taken is bounded for any
+ * number of candidates. Returns whether a subset was found.
+ */
+bool SelectCoinsExactMatch(const std::vector<CAmount>& vValue, const CAmount& nTargetValue,
+                           std::vector<char>& vfBest, CAmount& nBest, unsigned int nMaxTries = COINSELECTION_EXACT_MAX_TRIES);
+
+/**
+ * Randomized search for the subset closest above nTargetValue, keeping the
+ * best of the given number of iterations. nTotalLower is the sum of vValue.
+ * Takes time proportional to the number of candidates times the iterations.
+ */
+void ApproximateBestSubset(const std::vector<CAmount>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                           std::vector<char>& vfBest, CAmount& nBest, int iterations = 1000);
+
+/**
+ * Take the largest coins until nTargetValue is reached, which keeps the number
+ * of inputs low. Returns false if all of vValue does not reach the target.
+ */
+bool SelectCoinsLargestFirst(const std::vector<CAmount>& vValue, const CAmount& nTargetValue,
+                             std::vector<char>& vfBest, CAmount& nBest);
+
+#endif // BITCOIN_WALLET_COINSELECTION_H
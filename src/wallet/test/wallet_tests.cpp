@@ -3,6 +3,12 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet/wallet.h"
+#include "base58.h"
+#include "chain.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "wallet/coinselection.h"
 
 #include <set>
 #include <stdint.h>
@@ -23,6 +29,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_FIXTURE_TEST_SUITE(wallet_tests, TestingSetup)
@@ -307,4 +315,274 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_engines)
+{
+    vector<CAmount> vValue;
+    vValue.push_back(7 * CENT);
+    vValue.push_back(5 * CENT);
+    vValue.push_back(5 * CENT);
+    vValue.push_back(3 * CENT);
+    vValue.push_back(2 * CENT);
+    vector<char> vfBest;
+    CAmount nBest;
+
+    BOOST_CHECK(SelectCoinsExactMatch(vValue, 12 * CENT, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 12 * CENT);
+    BOOST_CHECK(vfBest[0] && vfBest[1] && !vfBest[2] && !vfBest[3] && !vfBest[4]);
+    // 5 + 5 + 3, only found after backtracking out of every subset with the 7
+    BOOST_CHECK(SelectCoinsExactMatch(vValue, 13 * CENT, vfBest, nBest));
+    BOOST_CHECK(!vfBest[0] && vfBest[1] && vfBest[2] && vfBest[3] && !vfBest[4]);
+    BOOST_CHECK(SelectCoinsExactMatch(vValue, 22 * CENT, vfBest, nBest));
+    BOOST_CHECK(!SelectCoinsExactMatch(vValue, 1 * CENT, vfBest, nBest));
+    BOOST_CHECK(!SelectCoinsExactMatch(vValue, 23 * CENT, vfBest, nBest));
+    // The search gives up after the given number of steps
+    BOOST_CHECK(!SelectCoinsExactMatch(vValue, 12 * CENT, vfBest, nBest, 2));
+
+    BOOST_CHECK(SelectCoinsLargestFirst(vValue, 11 * CENT, vfBest, nBest));
+    BOOST_CHECK_EQUAL(nBest, 12 * CENT);
+    BOOST_CHECK(vfBest[0] && vfBest[1] && !vfBest[2]);
+    BOOST_CHECK(!SelectCoinsLargestFirst(vValue, 23 * CENT, vfBest, nBest));
+
+    LOCK(wallet.cs_wallet);
+
+    // With many small coins, selection falls back to largest-first and leaves a cent of change
+    empty_wallet();
+    for (unsigned int i = 0; i < 2 * COINSELECTION_MAX_STOCHASTIC_COINS; i++)
+        add_coin(3 * CENT + i);
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+    BOOST_CHECK(wallet.SelectCoinsMinConf(10 * COIN + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_GE(nValueRet, 10 * COIN + 1 + CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 334U);
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(ismine_filter)
+{
+    CWallet keywallet;
+    CKey key, keyWatch, keyOther;
+    key.MakeNewKey(true);
+    keyWatch.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+
+    CScript scriptInner = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptWatch = GetScriptForDestination(keyWatch.GetPubKey().GetID());
+    {
+        LOCK(keywallet.cs_wallet);
+        BOOST_CHECK(keywallet.AddKeyPubKey(key, key.GetPubKey()));
+        BOOST_CHECK(keywallet.AddCScript(scriptInner));
+        BOOST_CHECK(keywallet.AddWatchOnly(scriptWatch));
+    }
+
+    std::vector<CPubKey> vBoth, vOther;
+    vBoth.push_back(key.GetPubKey());
+    vBoth.push_back(keyOther.GetPubKey());
+    vOther.push_back(keyOther.GetPubKey());
+
+    std::vector<CScript> vScripts;
+    vScripts.push_back(CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG);
+    vScripts.push_back(scriptInner);
+    vScripts.push_back(GetScriptForDestination(CScriptID(scriptInner)));
+    vScripts.push_back(scriptWatch);
+    vScripts.push_back(GetScriptForMultisig(1, vBoth));
+    vScripts.push_back(GetScriptForDestination(keyOther.GetPubKey().GetID()));
+    vScripts.push_back(GetScriptForMultisig(1, vOther));
+    vScripts.push_back(CScript() << OP_RETURN);
+
+    // Everything IsMine() accepts is matched; outputs paying only to others are not.
+    CIsMineFilter filter = keywallet.GetIsMineFilter();
+    BOOST_FOREACH(const CScript& script, vScripts)
+        BOOST_CHECK(filter.Matches(script) || IsMine(keywallet, script) == ISMINE_NO);
+    BOOST_CHECK(filter.Matches(vScripts[4]));
+    BOOST_CHECK(!filter.Matches(vScripts[5]));
+    BOOST_CHECK(!filter.Matches(vScripts[6]));
+    BOOST_CHECK(!filter.Matches(vScripts[7]));
+}
+
+BOOST_AUTO_TEST_CASE(keypool_topup)
+{
+    LOCK(pwalletMain->cs_wallet);
+
+    // More keys than one batch, generated in parallel
+    unsigned int nKeys = KEYPOOL_TOPUP_BATCH + 10;
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nKeys));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nKeys + 1);
+
+    set<CKeyID> setKeys;
+    for (unsigned int i = 0; i < nKeys + 1; i++) {
+        CPubKey key;
+        BOOST_CHECK(pwalletMain->GetKeyFromPool(key));
+        BOOST_CHECK(pwalletMain->HaveKey(key.GetID()));
+        setKeys.insert(key.GetID());
+    }
+    BOOST_CHECK_EQUAL(setKeys.size(), nKeys + 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 0U);
+
+    // A dry pool only gets the key asked for, and one spare, in the foreground
+    CPubKey key;
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(key));
+    BOOST_CHECK(!setKeys.count(key.GetID()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 1U);
+}
+
+/**
+ * Reads the wallet file in a transaction that does not wait for locks, so
+ * records written by an open transaction read as missing instead of blocking.
+ */
+class CWalletDBNoWait : public CWalletDB
+{
+public:
+    CWalletDBNoWait(const std::string& strFilename) : CWalletDB(strFilename, "r", false)
+    {
+        activeTxn = bitdb.TxnBegin(DB_TXN_NOWAIT);
+    }
+
+    bool HaveName(const CTxDestination& dest)
+    {
+        return Exists(make_pair(string("name"), CBitcoinAddress(dest).ToString()));
+    }
+};
+
+static bool HaveNameRecord(const CTxDestination& dest)
+{
+    return CWalletDBNoWait("wallet.dat").HaveName(dest);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_batch)
+{
+    LOCK(pwalletMain->cs_wallet);
+    vector<CTxDestination> vDest;
+    for (int i = 0; i < 4; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vDest.push_back(key.GetPubKey().GetID());
+    }
+
+    // Outside a batch, every write is committed right away
+    BOOST_CHECK(pwalletMain->SetAddressBook(vDest[0], "zero", "receive"));
+    BOOST_CHECK(HaveNameRecord(vDest[0]));
+
+    // Nested batches only commit at the outermost CommitBatch()
+    pwalletMain->BeginBatch();
+    pwalletMain->BeginBatch();
+    BOOST_CHECK(pwalletMain->SetAddressBook(vDest[1], "one", "receive"));
+    BOOST_CHECK(pwalletMain->CommitBatch());
+    BOOST_CHECK(!HaveNameRecord(vDest[1]));
+    BOOST_CHECK(pwalletMain->SetAddressBook(vDest[2], "two", "receive"));
+    BOOST_CHECK(pwalletMain->CommitBatch());
+    BOOST_CHECK(HaveNameRecord(vDest[1]));
+    BOOST_CHECK(HaveNameRecord(vDest[2]));
+
+    // Removals are committed along with the other writes, so the file ends
+    // up matching the address book in memory
+    pwalletMain->BeginBatch();
+    BOOST_CHECK(pwalletMain->SetAddressBook(vDest[3], "three", "receive"));
+    BOOST_CHECK(pwalletMain->DelAddressBook(vDest[0]));
+    BOOST_CHECK(HaveNameRecord(vDest[0]));
+    BOOST_CHECK(pwalletMain->CommitBatch());
+    BOOST_CHECK(HaveNameRecord(vDest[3]));
+    BOOST_CHECK(!HaveNameRecord(vDest[0]));
+    BOOST_CHECK(!pwalletMain->mapAddressBook.count(vDest[0]));
+
+    // The next write goes straight to the file again
+    BOOST_CHECK(pwalletMain->SetAddressBook(vDest[0], "zero", "receive"));
+    BOOST_CHECK(HaveNameRecord(vDest[0]));
+}
+
+static bool IsListedUnspent(const uint256& hash)
+{
+    BOOST_FOREACH(const CWalletTx* pwtx, pwalletMain->GetUnspentTxs())
+        if (pwtx->GetHash() == hash)
+            return true;
+    return false;
+}
+
+/** The balance from a scan of all wallet transactions, bypassing the credit caches */
+static CAmount GetBalanceByScan()
+{
+    CAmount nTotal = 0;
+    for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+        if (it->second.IsTrusted())
+            nTotal += it->second.GetAvailableCredit(false);
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_unspent_txs)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_REQUIRE(pwalletMain->AddKey(key));
+
+    // A transaction paying to the wallet, and one spending that output elsewhere
+    CMutableTransaction txReceive;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txReceive.vout.resize(1);
+    txReceive.vout[0].nValue = COIN;
+    txReceive.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    const uint256 hashReceive = txReceive.GetHash();
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(hashReceive, 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = COIN;
+    txSpend.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    const uint256 hashSpend = txSpend.GetHash();
+
+    // A block for each, connected on top of the genesis block without validation
+    CBlockIndex* pindexGenesis = chainActive.Tip();
+    vector<CBlock> vBlocks(2);
+    vector<uint256> vHash(2);
+    vector<CBlockIndex> vIndex(2);
+    for (int i = 0; i < 2; i++) {
+        vBlocks[i].vtx.push_back(i ? CTransaction(txSpend) : CTransaction(txReceive));
+        vBlocks[i].hashPrevBlock = i ? vHash[0] : pindexGenesis->GetBlockHash();
+        vBlocks[i].hashMerkleRoot = vBlocks[i].BuildMerkleTree();
+        vHash[i] = vBlocks[i].GetHash();
+        vIndex[i] = CBlockIndex(vBlocks[i]);
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pprev = i ? &vIndex[0] : pindexGenesis;
+        vIndex[i].nHeight = pindexGenesis->nHeight + 1 + i;
+        mapBlockIndex[vHash[i]] = &vIndex[i];
+    }
+
+    // A confirmed payment is listed and counted
+    chainActive.SetTip(&vIndex[0]);
+    pwalletMain->SyncTransaction(txReceive, &vBlocks[0]);
+    BOOST_CHECK(IsListedUnspent(hashReceive));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), GetBalanceByScan());
+
+    // Once its spend confirms, it is settled and dropped; the spend pays
+    // nothing to the wallet, so it is not listed either
+    chainActive.SetTip(&vIndex[1]);
+    pwalletMain->SyncTransaction(txSpend, &vBlocks[1]);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), GetBalanceByScan());
+    BOOST_CHECK(!IsListedUnspent(hashReceive));
+    BOOST_CHECK(!IsListedUnspent(hashSpend));
+
+    // Disconnecting the spend's block passes the spend to SyncTransaction()
+    // again, which brings the payment back
+    chainActive.SetTip(&vIndex[0]);
+    pwalletMain->SyncTransaction(txSpend, NULL);
+    BOOST_CHECK(IsListedUnspent(hashReceive));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), GetBalanceByScan());
+
+    // So does erasing a confirmed spend
+    chainActive.SetTip(&vIndex[1]);
+    pwalletMain->SyncTransaction(txSpend, &vBlocks[1]);
+    BOOST_CHECK(!IsListedUnspent(hashReceive));
+    pwalletMain->EraseFromWallet(hashSpend);
+    BOOST_CHECK(IsListedUnspent(hashReceive));
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), COIN);
+    BOOST_CHECK_EQUAL(pwalletMain->GetBalance(), GetBalanceByScan());
+
+    chainActive.SetTip(pindexGenesis);
+    for (int i = 0; i < 2; i++)
+        mapBlockIndex.erase(vHash[i]);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
@@ -17,6 +18,7 @@
 #include "timedata.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "wallet/coinselection.h"
 
 #include <assert.h>
 
@@ -78,13 +80,22 @@ CPubKey CWallet::GenerateNewKey()
     CKey secret;
     secret.MakeNewKey(fCompressed);
 
-    // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
-        SetMinVersion(FEATURE_COMPRPUBKEY);
-
     CPubKey pubkey = secret.GetPubKey();
     assert(secret.VerifyPubKey(pubkey));
 
+    if (!AddGeneratedKey(secret, pubkey))
+        throw std::runtime_error("CWallet::GenerateNewKey(): AddKey failed");
+    return pubkey;
+}
+
+bool CWallet::AddGeneratedKey(const CKey& secret, const CPubKey& pubkey)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (secret.IsCompressed())
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
     // Create new metadata
     int64_t nCreationTime = GetTime();
 
@@ -100,9 +111,7 @@ CPubKey CWallet::GenerateNewKey()
     if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
         nTimeFirstKey = nCreationTime;
 
-    if (!AddKeyPubKey(secret, pubkey))
-        throw std::runtime_error("CWallet::GenerateNewKey(): AddKey failed");
-    return pubkey;
+    return AddKeyPubKey(secret, pubkey);
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
@@ -120,9 +129,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
-        return CWalletDB(strWalletFile).WriteKey(pubkey,
-                                                 secret.GetPrivKey(),
-                                                 mapKeyMetadata[pubkey.GetID()]);
+        boost::scoped_ptr<CWalletDB> pwalletdb;
+        return GetWalletDB(pwalletdb).WriteKey(pubkey,
+                                               secret.GetPrivKey(),
+                                               mapKeyMetadata[pubkey.GetID()]);
     }
     return true;
 }
@@ -140,10 +150,12 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
-        else
-            return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
-                                                            vchCryptedSecret,
-                                                            mapKeyMetadata[vchPubKey.GetID()]);
+        else {
+            boost::scoped_ptr<CWalletDB> pwalletdb;
+            return GetWalletDB(pwalletdb).WriteCryptedKey(vchPubKey,
+                                                          vchCryptedSecret,
+                                                          mapKeyMetadata[vchPubKey.GetID()]);
+        }
     }
     return false;
 }
@@ -169,7 +181,9 @@ bool CWallet::AddCScript(const CScript& redeemScript)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
+    LOCK(cs_wallet);
+    boost::scoped_ptr<CWalletDB> pwalletdb;
+    return GetWalletDB(pwalletdb).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
 bool CWallet::LoadCScript(const CScript& redeemScript)
@@ -196,7 +210,9 @@ bool CWallet::AddWatchOnly(const CScript &dest)
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteWatchOnly(dest);
+    LOCK(cs_wallet);
+    boost::scoped_ptr<CWalletDB> pwalletdb;
+    return GetWalletDB(pwalletdb).WriteWatchOnly(dest);
 }
 
 bool CWallet::RemoveWatchOnly(const CScript &dest)
@@ -206,9 +222,11 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
         return false;
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
-    if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+    if (fFileBacked) {
+        boost::scoped_ptr<CWalletDB> pwalletdb;
+        if (!GetWalletDB(pwalletdb).EraseWatchOnly(dest))
             return false;
+    }
 
     return true;
 }
@@ -273,7 +291,8 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
                     return false;
                 if (!crypter.Encrypt(vMasterKey, pMasterKey.second.vchCryptedKey))
                     return false;
-                CWalletDB(strWalletFile).WriteMasterKey(pMasterKey.first, pMasterKey.second);
+                boost::scoped_ptr<CWalletDB> pwalletdb;
+                GetWalletDB(pwalletdb).WriteMasterKey(pMasterKey.first, pMasterKey.second);
                 if (fWasLocked)
                     Lock();
                 return true;
@@ -307,11 +326,10 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
 
     if (fFileBacked)
     {
-        CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
+        boost::scoped_ptr<CWalletDB> pwalletdbOwn;
+        CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : &GetWalletDB(pwalletdbOwn);
         if (nWalletVersion > 40000)
             pwalletdb->WriteMinVersion(nWalletVersion);
-        if (!pwalletdbIn)
-            delete pwalletdb;
     }
 
     return true;
@@ -581,15 +599,77 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
     } else {
-        CWalletDB(strWalletFile).WriteOrderPosNext(nOrderPosNext);
+        boost::scoped_ptr<CWalletDB> pwalletdbOwn;
+        GetWalletDB(pwalletdbOwn).WriteOrderPosNext(nOrderPosNext);
     }
     return nRet;
 }
 
+CWalletDB& CWallet::GetWalletDB(boost::scoped_ptr<CWalletDB>& pwalletdbOwn, bool fFlushOnClose)
+{
+    AssertLockHeld(cs_wallet);
+    if (pwalletdbBatch)
+        return *pwalletdbBatch;
+    pwalletdbOwn.reset(new CWalletDB(strWalletFile, "r+", fFlushOnClose));
+    return *pwalletdbOwn;
+}
+
+void CWallet::BeginBatch(bool fFlush)
+{
+    AssertLockHeld(cs_wallet);
+    if (nBatchDepth++ > 0 || !fFileBacked)
+        return;
+    pwalletdbBatch = new CWalletDB(strWalletFile, "r+", fFlush);
+    if (!pwalletdbBatch->TxnBegin()) {
+        // Fall back to writing record by record
+        LogPrintf("%s: Could not begin a database transaction\n", __func__);
+        delete pwalletdbBatch;
+        pwalletdbBatch = NULL;
+    }
+}
+
+bool CWallet::CommitBatch()
+{
+    AssertLockHeld(cs_wallet);
+    assert(nBatchDepth > 0);
+    if (--nBatchDepth > 0 || !pwalletdbBatch)
+        return true;
+    boost::scoped_ptr<CWalletDB> pwalletdb(pwalletdbBatch);
+    pwalletdbBatch = NULL;
+    if (!pwalletdb->TxnCommit())
+        return error("%s: Could not commit the database transaction", __func__);
+    return true;
+}
+
+namespace {
+/**
+ * Batches a wallet's writes for the scope, committing them also when leaving
+ * it by exception: each write mirrors a change already made in memory, so
+ * dropping them would leave the wallet running on state that is not on disk.
+ */
+class CWalletBatch
+{
+private:
+    CWallet& wallet;
+
+public:
+    CWalletBatch(CWallet& walletIn, bool fFlush = true) : wallet(walletIn)
+    {
+        wallet.BeginBatch(fFlush);
+    }
+
+    ~CWalletBatch()
+    {
+        wallet.CommitBatch();
+    }
+};
+} // anon namespace
+
 CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
 {
     AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
+    boost::scoped_ptr<CWalletDB> pwalletdb;
+    CWalletDB& walletdb = GetWalletDB(pwalletdb);
 
     // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
     TxItems txOrdered;
@@ -615,8 +695,10 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet) {
             item.second.MarkDirty();
+            setUnspentTxs.insert(item.first);
+        }
     }
 }
 
@@ -629,6 +711,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        setUnspentTxs.insert(hash);
     }
     else
     {
@@ -723,6 +806,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        setUnspentTxs.insert(hash);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -761,14 +845,22 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 
             // Do not flush the wallet here for performance reasons
             // this is safe, as in case of a crash, we rescan the necessary blocks on startup through our SetBestChain-mechanism
-            CWalletDB walletdb(strWalletFile, "r+", false);
+            boost::scoped_ptr<CWalletDB> pwalletdb;
 
-            return AddToWallet(wtx, false, &walletdb);
+            return AddToWallet(wtx, false, &GetWalletDB(pwalletdb, false));
         }
     }
     return false;
 }
 
+void CWallet::BlockConnected(const CBlock& block, const std::list<CTransaction>& txConflicted)
+{
+    LOCK2(cs_main, cs_wallet);
+    // Write what the block changes in the wallet at once
+    CWalletBatch batch(*this, false);
+    CValidationInterface::BlockConnected(block, txConflicted);
+}
+
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
@@ -780,8 +872,10 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // recomputed, also:
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        if (mapWallet.count(txin.prevout.hash))
+        if (mapWallet.count(txin.prevout.hash)) {
             mapWallet[txin.prevout.hash].MarkDirty();
+            setUnspentTxs.insert(txin.prevout.hash);
+        }
     }
 }
 
@@ -791,8 +885,21 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            return;
+        // The outputs it spent may be available again
+        BOOST_FOREACH(const CTxIn& txin, it->second.vin)
+        {
+            map<uint256, CWalletTx>::iterator mi = mapWallet.find(txin.prevout.hash);
+            if (mi != mapWallet.end()) {
+                mi->second.MarkDirty();
+                setUnspentTxs.insert(txin.prevout.hash);
+            }
+        }
+        mapWallet.erase(hash);
+        boost::scoped_ptr<CWalletDB> pwalletdb;
+        GetWalletDB(pwalletdb).EraseTx(hash);
     }
     return;
 }
@@ -1060,10 +1167,96 @@ bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
     return pwalletdb->WriteTx(GetHash(), *this);
 }
 
+namespace {
+/** Number of blocks read ahead while rescanning */
+static const unsigned int RESCAN_BATCH_BLOCKS = 64;
+
+/** A block read by the rescan, with the transactions that may pay to us */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    //! Positions in block.vtx of the transactions with an output matching the filter
+    std::vector<unsigned int> vMatches;
+
+    CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn) {}
+};
+
+/** Closure reading a block from disk and matching its outputs against the wallet's keys */
+class CRescanBlockCheck
+{
+private:
+    CRescanBlock* pentry;
+    const CIsMineFilter* pfilter;
+
+public:
+    CRescanBlockCheck() : pentry(NULL), pfilter(NULL) {}
+    CRescanBlockCheck(CRescanBlock* pentryIn, const CIsMineFilter* pfilterIn) : pentry(pentryIn), pfilter(pfilterIn) {}
+
+    bool operator()()
+    {
+        if (!ReadBlockFromDisk(pentry->block, pentry->pindex)) {
+            pentry->block.SetNull();
+            return true;
+        }
+        for (unsigned int i = 0; i < pentry->block.vtx.size(); i++) {
+            BOOST_FOREACH(const CTxOut& txout, pentry->block.vtx[i].vout) {
+                if (pfilter->Matches(txout.scriptPubKey)) {
+                    pentry->vMatches.push_back(i);
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    void swap(CRescanBlockCheck& check)
+    {
+        std::swap(pentry, check.pentry);
+        std::swap(pfilter, check.pfilter);
+    }
+};
+
+void ThreadRescanCheck(CCheckQueue<CRescanBlockCheck>* pqueue)
+{
+    RenameThread("bitcoin-rescan");
+    pqueue->Thread();
+}
+
+/** Interrupts and joins the rescan threads when the scan ends, also by exception */
+class CRescanThreadGroup
+{
+public:
+    boost::thread_group threads;
+
+    ~CRescanThreadGroup()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+};
+} // anon namespace
+
+CIsMineFilter CWallet::GetIsMineFilter() const
+{
+    CIsMineFilter filter;
+    LOCK(cs_KeyStore);
+    GetKeys(filter.setKeys);
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); it++)
+        filter.setScripts.insert(it->first);
+    filter.setWatchOnly = setWatchOnly;
+    return filter;
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * Blocks are read and matched against a copy of the wallet's keys in
+ * batches, by as many threads as script verification uses. Transactions
+ * are then added in chain order, considering only those paying to a
+ * match or spending from or updating a wallet transaction.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -1080,23 +1273,66 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        const CIsMineFilter filter = GetIsMineFilter();
+        CCheckQueue<CRescanBlockCheck> queue(1);
+        CRescanThreadGroup workers;
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            workers.threads.create_thread(boost::bind(&ThreadRescanCheck, &queue));
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
         while (pindex)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            // Read a batch of blocks...
+            std::vector<CRescanBlock> vBatch;
+            vBatch.reserve(RESCAN_BATCH_BLOCKS);
+            for (; pindex && vBatch.size() < RESCAN_BATCH_BLOCKS; pindex = chainActive.Next(pindex))
+                vBatch.push_back(CRescanBlock(pindex));
+            {
+                std::vector<CRescanBlockCheck> vChecks;
+                vChecks.reserve(vBatch.size());
+                BOOST_FOREACH(CRescanBlock& entry, vBatch) {
+                    CRescanBlockCheck check(&entry, &filter);
+                    vChecks.push_back(CRescanBlockCheck());
+                    check.swap(vChecks.back());
+                }
+                CCheckQueueControl<CRescanBlockCheck> control(&queue);
+                control.Add(vChecks);
+                control.Wait();
+            }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            // ...and add the transactions involving us in chain order.
+            CWalletBatch batch(*this, false);
+            BOOST_FOREACH(const CRescanBlock& entry, vBatch)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                if (entry.pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), entry.pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                std::vector<unsigned int>::const_iterator itMatch = entry.vMatches.begin();
+                for (unsigned int i = 0; i < entry.block.vtx.size(); i++)
+                {
+                    const CTransaction& tx = entry.block.vtx[i];
+                    bool fCandidate = itMatch != entry.vMatches.end() && *itMatch == i;
+                    if (fCandidate)
+                        itMatch++;
+                    // Transactions without a matching output can only involve
+                    // us by being in the wallet already or spending from it.
+                    if (!fCandidate && !mapWallet.count(tx.GetHash())) {
+                        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                            if (mapWallet.count(txin.prevout.hash)) {
+                                fCandidate = true;
+                                break;
+                            }
+                        }
+                        if (!fCandidate)
+                            continue;
+                    }
+                    if (AddToWalletIfInvolvingMe(tx, &entry.block, fUpdate))
+                        ret++;
+                }
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
+            if (pindex && GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
             }
@@ -1409,14 +1645,51 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
  */
 
 
+bool CWallet::IsSettled(const CWalletTx& wtx) const
+{
+    // Outputs spent by unconfirmed transactions may become available again without
+    // the wallet being told, e.g. when the spend leaves the mempool. Confirmed spends
+    // only change through SyncTransaction, which puts the transaction back.
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+        bool fSpent = false;
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range = mapTxSpends.equal_range(COutPoint(wtx.GetHash(), i));
+        for (TxSpends::const_iterator it = range.first; it != range.second && !fSpent; ++it) {
+            map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            fSpent = mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0;
+        }
+        if (!fSpent)
+            return false;
+    }
+    return true;
+}
+
+std::vector<const CWalletTx*> CWallet::GetUnspentTxs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    std::vector<const CWalletTx*> vTxs;
+    std::set<uint256>::iterator it = setUnspentTxs.begin();
+    while (it != setUnspentTxs.end()) {
+        map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(*it);
+        if (mit == mapWallet.end() || IsSettled(mit->second)) {
+            setUnspentTxs.erase(it++);
+            continue;
+        }
+        vTxs.push_back(&mit->second);
+        ++it;
+    }
+    return vTxs;
+}
+
 CAmount CWallet::GetBalance() const
 {
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1430,9 +1703,8 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1445,9 +1717,8 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -1459,9 +1730,8 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1475,9 +1745,8 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             if (!CheckFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1490,9 +1759,8 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const CWalletTx* pcoin = &(*it).second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
@@ -1508,10 +1776,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const CWalletTx* pcoin, GetUnspentTxs())
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -1529,60 +1796,14 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
-                                  vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        CAmount nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng is fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
@@ -1649,14 +1870,28 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Solve subset sum: look for an exact match first, which needs no change
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
+    vector<CAmount> vAmounts;
+    vAmounts.reserve(vValue.size());
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        vAmounts.push_back(vValue[i].first);
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    if (!SelectCoinsExactMatch(vAmounts, nTargetValue, vfBest, nBest))
+    {
+        // Otherwise try to leave at least a cent of change, by stochastic
+        // approximation, or largest-first where that would take too long.
+        CAmount nTarget = nTotalLower >= nTargetValue + CENT ? nTargetValue + CENT : nTargetValue;
+        if (vAmounts.size() <= COINSELECTION_MAX_STOCHASTIC_COINS) {
+            ApproximateBestSubset(vAmounts, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+            if (nBest != nTargetValue && nTarget != nTargetValue)
+                ApproximateBestSubset(vAmounts, nTotalLower, nTarget, vfBest, nBest, 1000);
+        } else {
+            SelectCoinsLargestFirst(vAmounts, nTarget, vfBest, nBest);
+        }
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -2079,17 +2314,16 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
         LOCK2(cs_main, cs_wallet);
         LogPrintf("CommitTransaction:\n%s", wtxNew.ToString());
         {
-            // This is only to keep the database open to defeat the auto-flush for the
-            // duration of this scope.  This is the only place where this optimization
-            // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r+") : NULL;
+            // Keep the key and record the transaction in a single database transaction
+            CWalletBatch batch(*this);
+            boost::scoped_ptr<CWalletDB> pwalletdb;
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
 
             // Add tx to wallet, because if it has change it's also ours,
             // otherwise just for transaction history.
-            AddToWallet(wtxNew, false, pwalletdb);
+            AddToWallet(wtxNew, false, fFileBacked ? &GetWalletDB(pwalletdb) : NULL);
 
             // Notify that old coins are spent
             set<CWalletTx*> setCoins;
@@ -2099,9 +2333,6 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
-
-            if (fFileBacked)
-                delete pwalletdb;
         }
 
         // Track how many getdata requests our transaction gets
@@ -2215,9 +2446,12 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
     if (!fFileBacked)
         return false;
-    if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
+    LOCK(cs_wallet);
+    boost::scoped_ptr<CWalletDB> pwalletdb;
+    CWalletDB& walletdb = GetWalletDB(pwalletdb);
+    if (!strPurpose.empty() && !walletdb.WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
         return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    return walletdb.WriteName(CBitcoinAddress(address).ToString(), strName);
 }
 
 bool CWallet::DelAddressBook(const CTxDestination& address)
@@ -2229,9 +2463,11 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
         {
             // Delete destdata tuples associated with address
             std::string strAddress = CBitcoinAddress(address).ToString();
+            boost::scoped_ptr<CWalletDB> pwalletdb;
+            CWalletDB& walletdb = GetWalletDB(pwalletdb);
             BOOST_FOREACH(const PAIRTYPE(string, string) &item, mapAddressBook[address].destdata)
             {
-                CWalletDB(strWalletFile).EraseDestData(strAddress, item.first);
+                walletdb.EraseDestData(strAddress, item.first);
             }
         }
         mapAddressBook.erase(address);
@@ -2241,15 +2477,20 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
 
     if (!fFileBacked)
         return false;
-    CWalletDB(strWalletFile).ErasePurpose(CBitcoinAddress(address).ToString());
-    return CWalletDB(strWalletFile).EraseName(CBitcoinAddress(address).ToString());
+    LOCK(cs_wallet);
+    boost::scoped_ptr<CWalletDB> pwalletdb;
+    CWalletDB& walletdb = GetWalletDB(pwalletdb);
+    walletdb.ErasePurpose(CBitcoinAddress(address).ToString());
+    return walletdb.EraseName(CBitcoinAddress(address).ToString());
 }
 
 bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
 {
     if (fFileBacked)
     {
-        if (!CWalletDB(strWalletFile).WriteDefaultKey(vchPubKey))
+        LOCK(cs_wallet);
+        boost::scoped_ptr<CWalletDB> pwalletdb;
+        if (!GetWalletDB(pwalletdb).WriteDefaultKey(vchPubKey))
             return false;
     }
     vchDefaultKey = vchPubKey;
@@ -2284,35 +2525,101 @@ bool CWallet::NewKeyPool()
     return true;
 }
 
+namespace {
+void MakeNewKeyRange(std::vector<CKey>* pvKeys, std::vector<CPubKey>* pvPubKeys, unsigned int nBegin, unsigned int nEnd, bool fCompressed)
+{
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        (*pvKeys)[i].MakeNewKey(fCompressed);
+        (*pvPubKeys)[i] = (*pvKeys)[i].GetPubKey();
+        assert((*pvKeys)[i].VerifyPubKey((*pvPubKeys)[i]));
+    }
+}
+
+/** Fill vKeys with new keys, and vPubKeys with their public keys, using all cores */
+void MakeNewKeys(std::vector<CKey>& vKeys, std::vector<CPubKey>& vPubKeys, bool fCompressed)
+{
+    // The workers write into the vectors, so they must be joined before leaving
+    boost::this_thread::disable_interruption di;
+    boost::thread_group threads;
+    unsigned int nThreads = std::max(1, std::min(GetNumCores(), (int)vKeys.size()));
+    unsigned int nBegin = 0;
+    for (unsigned int t = 1; t < nThreads; t++) {
+        unsigned int nEnd = vKeys.size() * t / nThreads;
+        threads.create_thread(boost::bind(&MakeNewKeyRange, &vKeys, &vPubKeys, nBegin, nEnd, fCompressed));
+        nBegin = nEnd;
+    }
+    MakeNewKeyRange(&vKeys, &vPubKeys, nBegin, vKeys.size(), fCompressed);
+    threads.join_all();
+}
+} // anon namespace
+
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
-    {
-        LOCK(cs_wallet);
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
 
-        if (IsLocked())
-            return false;
+    while (true)
+    {
+        boost::this_thread::interruption_point();
 
-        CWalletDB walletdb(strWalletFile);
+        unsigned int nKeys;
+        bool fCompressed;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                return true;
+            nKeys = std::min((unsigned int)(nTargetSize + 1 - setKeyPool.size()), KEYPOOL_TOPUP_BATCH);
+            fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // see GenerateNewKey()
+        }
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
+        // Generate a batch of keys, without holding cs_wallet unless the caller does...
+        std::vector<CKey> vKeys(nKeys);
+        std::vector<CPubKey> vPubKeys(nKeys);
+        MakeNewKeys(vKeys, vPubKeys, fCompressed);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+        // ...and add them with their pool entries in one write.
+        LOCK(cs_wallet);
+        if (IsLocked())
+            return false;
+        CWalletBatch batch(*this);
+        boost::scoped_ptr<CWalletDB> pwalletdb;
+        CWalletDB& walletdb = GetWalletDB(pwalletdb);
+        unsigned int nAdded = 0;
+        for (; nAdded < nKeys; nAdded++)
         {
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            // LockWallet() does not take cs_wallet, so the wallet may lock
+            // while the batch is open. Stop then; the batch still commits the
+            // keys added so far, which are already in memory.
+            if (!AddGeneratedKey(vKeys[nAdded], vPubKeys[nAdded]))
+                break;
+            if (!walletdb.WritePool(nEnd, CKeyPool(vPubKeys[nAdded])))
                 throw runtime_error("TopUpKeyPool(): writing generated key failed");
             setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
         }
+        LogPrintf("keypool added %u keys, size=%u\n", nAdded, setKeyPool.size());
+        if (nAdded < nKeys)
+            return false;
+    }
+}
+
+void CWallet::MaintainKeyPool()
+{
+    try {
+        TopUpKeyPool();
+    } catch (const boost::thread_interrupted&) {
+        throw;
+    } catch (const std::exception& e) {
+        // Keep the scheduler thread alive, e.g. when the wallet was locked mid-batch
+        LogPrintf("%s: %s\n", __func__, e.what());
     }
-    return true;
 }
 
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
@@ -2322,14 +2629,17 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        // The pool is topped up in the background by MaintainKeyPool();
+        // only generate keys here if it has run dry.
+        if (setKeyPool.empty() && !IsLocked())
+            TopUpKeyPool(1);
 
         // Get the oldest key
         if(setKeyPool.empty())
             return;
 
-        CWalletDB walletdb(strWalletFile);
+        boost::scoped_ptr<CWalletDB> pwalletdb;
+        CWalletDB& walletdb = GetWalletDB(pwalletdb);
 
         nIndex = *(setKeyPool.begin());
         setKeyPool.erase(setKeyPool.begin());
@@ -2347,8 +2657,9 @@ void CWallet::KeepKey(int64_t nIndex)
     // Remove from key pool
     if (fFileBacked)
     {
-        CWalletDB walletdb(strWalletFile);
-        walletdb.ErasePool(nIndex);
+        LOCK(cs_wallet);
+        boost::scoped_ptr<CWalletDB> pwalletdb;
+        GetWalletDB(pwalletdb).ErasePool(nIndex);
     }
     LogPrintf("keypool keep %d\n", nIndex);
 }
@@ -2734,7 +3045,9 @@ bool CWallet::AddDestData(const CTxDestination &dest, const std::string &key, co
     mapAddressBook[dest].destdata.insert(std::make_pair(key, value));
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).WriteDestData(CBitcoinAddress(dest).ToString(), key, value);
+    LOCK(cs_wallet);
+    boost::scoped_ptr<CWalletDB> pwalletdb;
+    return GetWalletDB(pwalletdb).WriteDestData(CBitcoinAddress(dest).ToString(), key, value);
 }
 
 bool CWallet::EraseDestData(const CTxDestination &dest, const std::string &key)
@@ -2743,7 +3056,9 @@ bool CWallet::EraseDestData(const CTxDestination &dest, const std::string &key)
         return false;
     if (!fFileBacked)
         return true;
-    return CWalletDB(strWalletFile).EraseDestData(CBitcoinAddress(dest).ToString(), key);
+    LOCK(cs_wallet);
+    boost::scoped_ptr<CWalletDB> pwalletdb;
+    return GetWalletDB(pwalletdb).EraseDestData(CBitcoinAddress(dest).ToString(), key);
 }
 
 bool CWallet::LoadDestData(const CTxDestination &dest, const std::string &key, const std::string &value)
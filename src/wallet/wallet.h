@@ -28,6 +28,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+
 /**
  * Settings
  */
@@ -50,6 +52,10 @@ static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 2;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Number of keys generated and written together when topping up the key pool
+static const unsigned int KEYPOOL_TOPUP_BATCH = 100;
+//! Seconds between background checks whether the key pool needs topping up
+static const int64_t KEYPOOL_MAINTENANCE_INTERVAL = 1;
 
 class CAccountingEntry;
 class CBlockIndex;
@@ -450,6 +456,13 @@ private:
 
     CWalletDB *pwalletdbEncryption;
 
+    //! Handle whose transaction collects the writes of the current batch, see BeginBatch()
+    CWalletDB *pwalletdbBatch;
+    int nBatchDepth;
+
+    /** The handle of the current batch, if any, or a new one owned by pwalletdbOwn */
+    CWalletDB& GetWalletDB(boost::scoped_ptr<CWalletDB>& pwalletdbOwn, bool fFlushOnClose = true);
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -472,6 +485,16 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Wallet transactions that may have outputs that are ours and not spent by a
+     * confirmed transaction. Balance and coin queries only visit these, so they
+     * take time proportional to the unspent outputs rather than the whole history.
+     * A transaction is added whenever its credit caches are invalidated, and dropped
+     * when a query finds all its outputs settled.
+     */
+    mutable std::set<uint256> setUnspentTxs;
+    bool IsSettled(const CWalletTx& wtx) const;
+
 public:
     /*
      * Main wallet lock.
@@ -509,6 +532,8 @@ public:
     {
         delete pwalletdbEncryption;
         pwalletdbEncryption = NULL;
+        delete pwalletdbBatch;
+        pwalletdbBatch = NULL;
     }
 
     void SetNull()
@@ -518,6 +543,8 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
+        nBatchDepth = 0;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
@@ -559,6 +586,8 @@ public:
      * Generate a new key
      */
     CPubKey GenerateNewKey();
+    //! Adds a key just generated (and checked against its public key), with fresh metadata
+    bool AddGeneratedKey(const CKey& secret, const CPubKey& pubkey);
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
@@ -615,12 +644,28 @@ public:
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void BlockConnected(const CBlock& block, const std::list<CTransaction>& txConflicted);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     void EraseFromWallet(const uint256 &hash);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+
+    /**
+     * Collect the following writes to the wallet file into one database
+     * transaction, until the matching CommitBatch(). Batches nest, and only
+     * the outermost one commits. cs_wallet must be held throughout, as writes
+     * through other handles would wait for the transaction to end.
+     * If fFlush, the database log is flushed once the batch is committed.
+     */
+    void BeginBatch(bool fFlush = true);
+    /** End a batch. Returns false if the outermost one failed to commit. */
+    bool CommitBatch();
+    /** Copy of the keys and scripts IsMine() looks up, for matching outputs without cs_KeyStore */
+    CIsMineFilter GetIsMineFilter() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime);
+    /** The transactions of setUnspentTxs, dropping those found settled (requires cs_main and cs_wallet) */
+    std::vector<const CWalletTx*> GetUnspentTxs() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
@@ -637,6 +682,8 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    //! Tops up the key pool in the background, run periodically by the scheduler
+    void MaintainKeyPool();
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
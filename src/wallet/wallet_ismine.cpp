@@ -89,3 +89,34 @@ isminetype IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
         return ISMINE_WATCH_ONLY;
     return ISMINE_NO;
 }
+
+bool CIsMineFilter::Matches(const CScript& scriptPubKey) const
+{
+    if (setWatchOnly.count(scriptPubKey))
+        return true;
+
+    vector<valtype> vSolutions;
+    txnouttype whichType;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+
+    switch (whichType)
+    {
+    case TX_NONSTANDARD:
+    case TX_NULL_DATA:
+        break;
+    case TX_PUBKEY:
+        return setKeys.count(CPubKey(vSolutions[0]).GetID()) > 0;
+    case TX_PUBKEYHASH:
+        return setKeys.count(CKeyID(uint160(vSolutions[0]))) > 0;
+    case TX_SCRIPTHASH:
+        return setScripts.count(CScriptID(uint160(vSolutions[0]))) > 0;
+    case TX_MULTISIG:
+        // IsMine() requires all keys; any one of them is enough for a candidate
+        for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+            if (setKeys.count(CPubKey(vSolutions[i]).GetID()))
+                return true;
+        break;
+    }
+    return false;
+}
@@ -7,10 +7,12 @@
 #define BITCOIN_WALLET_WALLET_ISMINE_H
 
 #include "key.h"
+#include "script/script.h"
 #include "script/standard.h"
 
+#include <set>
+
 class CKeyStore;
-class CScript;
 
 /** IsMine() return codes */
 enum isminetype
@@ -26,4 +28,20 @@ typedef uint8_t isminefilter;
 isminetype IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest);
 
+/**
+ * Copy of the keys, scripts and watch-only scripts of a key store, used to
+ * match outputs without holding the key store lock. Matches() accepts every
+ * script IsMine() does, and some it does not (e.g. P2SH outputs whose redeem
+ * script is not spendable), so matches still have to be confirmed with IsMine().
+ */
+class CIsMineFilter
+{
+public:
+    std::set<CKeyID> setKeys;
+    std::set<CScriptID> setScripts;
+    std::set<CScript> setWatchOnly;
+
+    bool Matches(const CScript& scriptPubKey) const;
+};
+
 #endif // BITCOIN_WALLET_WALLET_ISMINE_H
@@ -141,23 +141,21 @@ bool CZMQPublishRawBlockNotifier::NotifyBlock(const uint256 &hash)
 {
     LogPrint("zmq", "Publish raw block %s\n", hash.GetHex());
 
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    // The stored bytes are already the serialized block
+    std::vector<unsigned char> vchBlock;
     {
         LOCK(cs_main);
 
-        CBlock block;
         CBlockIndex* pblockindex = mapBlockIndex[hash];
 
-        if(!ReadBlockFromDisk(block, pblockindex))
+        if(!ReadRawBlockFromDisk(vchBlock, pblockindex, Params().MessageStart()))
         {
             zmqError("Can't read block from disk");
             return false;
         }
-
-        ss << block;
     }
 
-    int rc = zmq_send_multipart(psocket, "rawblock", 8, &(*ss.begin()), ss.size(), 0);
+    int rc = zmq_send_multipart(psocket, "rawblock", 8, begin_ptr(vchBlock), vchBlock.size(), 0);
     return rc == 0;
 }
 